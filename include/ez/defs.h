@@ -16,6 +16,9 @@
 
 #define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
 
+/* y must be a power of 2 */
+#define round_up(x, y)		((((x) - 1) | ((typeof(x))((y) - 1))) + 1)
+
 #define min(x, y) ({				\
 	typeof(x) _min1 = (x);			\
 	typeof(y) _min2 = (y);			\
@@ -64,6 +67,14 @@
 
 #define ARRAY_SIZE(arr)		(sizeof(arr) / sizeof((arr)[0]))
 
+#ifndef __aligned
+#define __aligned(x)		__attribute__((__aligned__(x)))
+#endif
+
+#ifndef prefetch
+#define prefetch(x)	__builtin_prefetch(x)
+#endif
+
 #ifndef likely
 #define likely(x)	__builtin_expect(!!(x), 1)
 #endif
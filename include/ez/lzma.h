@@ -0,0 +1,289 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/include/ez/lzma.h - public interface of LZMA encoder and decoder
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#ifndef __EZ_LZMA_H
+#define __EZ_LZMA_H
+
+#include "defs.h"
+
+enum lzma_mf_type {
+	LZMA_MF_HC4,	/* hash chain with 2, 3 and 4-byte hashing */
+	LZMA_MF_BT4,	/* binary tree with 2, 3 and 4-byte hashing */
+	/* 64-byte buckets of recent positions with 2 and 4-byte hashing */
+	LZMA_MF_HB4,
+};
+
+struct lzma_mf_properties {
+	uint32_t dictsize;
+	enum lzma_mf_type type;
+
+	uint32_t nice_len, depth;
+	/*
+	 * if nonzero, nice_len and depth above are the upper bounds, and they
+	 * are adapted per region down to these by the matches found recently
+	 */
+	uint32_t nice_len_min, depth_min;
+	/*
+	 * find matches on a thread of its own ahead of the encoder, with the
+	 * same output as without (even if nice_len and depth are adapted)
+	 */
+	bool threaded;
+};
+
+#define LZMA_LAZY_MAX	2
+
+enum lzma_mode {
+	LZMA_MODE_FAST,		/* greedy/lazy parsing, lzma_get_optimum_fast() */
+	LZMA_MODE_NORMAL,	/* price-based optimal parsing */
+};
+
+/*
+ * Allocator of the large tables (window, hash tables and probabilities),
+ * which are kept across resets and only reallocated if they grow. The
+ * memory returned should be aligned to 64 bytes, and the size of each
+ * allocation is passed to free() as well. It's called from the worker
+ * threads of the block-parallel encoder, so it should be thread-safe.
+ */
+struct lzma_allocator {
+	void *(*alloc)(void *opaque, size_t size);
+	void (*free)(void *opaque, void *ptr, size_t size);
+	void *opaque;
+};
+
+/* map tables of 2MiB or more with transparent huge pages if possible */
+extern const struct lzma_allocator lzma_hugepage_allocator;
+
+struct lzma_properties {
+	uint32_t lc;	/* 0 <= lc <= 8, default = 3 */
+	uint32_t lp;	/* 0 <= lp <= 4, default = 0 */
+	uint32_t pb;	/* 0 <= pb <= 4, default = 2 */
+
+	enum lzma_mode mode;
+	/*
+	 * LZMA_MODE_FAST only, positions (up to LZMA_LAZY_MAX) looked ahead
+	 * for a cheaper match or rep by size estimates, 0 = LZMA SDK's rules
+	 */
+	uint32_t lazy;
+	struct lzma_mf_properties mf;
+
+	/* NULL to use the default (aligned_alloc) */
+	const struct lzma_allocator *allocator;
+};
+
+enum lzma_action {
+	LZMA_RUN,	/* more input will come later */
+	LZMA_FINISH,	/* the given input is the last, end the stream */
+};
+
+/* size of .lzma (LZMA_Alone) header */
+#define LZMA_HEADER_SIZE	13
+
+struct lzma_encoder;
+
+void lzma_default_properties(struct lzma_properties *p, int level);
+void lzma_encoder_header(const struct lzma_properties *p,
+			 uint8_t header[LZMA_HEADER_SIZE]);
+
+int lzma_encoder_init(struct lzma_encoder **lzmap,
+		      const struct lzma_properties *props);
+int lzma_encoder_reset(struct lzma_encoder *lzma,
+		       const struct lzma_properties *props);
+
+/*
+ * Use the last (up to dictsize) bytes of @dict as history of a new
+ * stream, which must be called before any input. The decoder should
+ * preset the same dictionary by lzma_decoder_preset_dict().
+ */
+int lzma_encoder_preset_dict(struct lzma_encoder *lzma,
+			     const uint8_t *dict, uint32_t size);
+
+/*
+ * A preset dictionary hashed in advance for many small streams, so that
+ * loading it into a new stream is a copy of the window and the used table
+ * entries instead of hashing it again. It's read-only once created, thus
+ * can be shared by encoders of other threads.
+ */
+struct lzma_encoder_dict;
+
+int lzma_encoder_dict_init(struct lzma_encoder_dict **dictp,
+			   const struct lzma_properties *props,
+			   const uint8_t *dict, uint32_t size);
+/*
+ * The same as lzma_encoder_preset_dict(), and the decoder should preset
+ * the same bytes. The match finder properties should be the same as the
+ * dictionary's, or it returns -EINVAL.
+ */
+int lzma_encoder_load_dict(struct lzma_encoder *lzma,
+			   const struct lzma_encoder_dict *dict);
+void lzma_encoder_dict_end(struct lzma_encoder_dict *dict);
+
+/*
+ * Compress [*in, iend) into [*out, oend) and advance *in and *out to what
+ * have been consumed and produced. The stream can be resumed by calling
+ * it again with the remaining input / new output space.
+ *
+ * Returns -ERANGE if all input has been consumed and more input is needed
+ * (LZMA_RUN), -ENOSPC if the output buffer is full, or 0 if the stream
+ * has been ended with an end marker (LZMA_FINISH).
+ */
+int lzma_encoder_update(struct lzma_encoder *lzma,
+			const uint8_t **in, const uint8_t *iend,
+			uint8_t **out, uint8_t *oend,
+			enum lzma_action action);
+
+/*
+ * Compress as much of [in, in + *insize) as possible into a complete
+ * stream of at most @outsize bytes (e.g. a 4KiB cluster), and set *insize
+ * to the number of input bytes consumed. The stream ends with an end
+ * marker only if @eopm, otherwise the decoder needs the uncompressed size.
+ *
+ * It must be called on a new stream (after lzma_encoder_reset() and an
+ * optional preset dictionary). Returns the compressed size, or -ENOSPC if
+ * even an empty stream doesn't fit.
+ */
+int lzma_encoder_destsize(struct lzma_encoder *lzma, const uint8_t *in,
+			  uint32_t *insize, uint8_t *out, uint32_t outsize,
+			  bool eopm);
+void lzma_encoder_end(struct lzma_encoder *lzma);
+
+/* the properties used by the last lzma_encoder_reset() */
+const struct lzma_properties *
+lzma_encoder_properties(const struct lzma_encoder *lzma);
+
+/*
+ * A thread-safe pool of idle encoders for compressing many small blocks.
+ * Encoders are reset when they are put back, so that the next get with
+ * the same properties only takes one out without touching the tables.
+ */
+struct lzma_encoder_pool;
+
+/* keep up to max_idle idle encoders, 0 = the default (64) */
+int lzma_encoder_pool_init(struct lzma_encoder_pool **poolp,
+			   unsigned int max_idle);
+/* get an encoder ready for a new stream of @props, or create one */
+int lzma_encoder_pool_get(struct lzma_encoder_pool *pool,
+			  struct lzma_encoder **lzmap,
+			  const struct lzma_properties *props);
+/* return an encoder in any state, which is ended if the pool is full */
+void lzma_encoder_pool_put(struct lzma_encoder_pool *pool,
+			   struct lzma_encoder *lzma);
+void lzma_encoder_pool_end(struct lzma_encoder_pool *pool);
+
+/*
+ * LZMA2 (raw, as the filter of .xz) splits the stream into chunks of at
+ * most 64KiB compressed, and incompressible chunks are stored as they are.
+ * lc + lp can't be more than 4.
+ */
+struct lzma2_encoder;
+
+int lzma2_encoder_init(struct lzma2_encoder **lzma2p,
+		       const struct lzma_properties *props);
+/*
+ * The same as lzma_encoder_update(), but the stream is ended with an end
+ * of stream chunk instead of an end marker (LZMA_FINISH).
+ */
+int lzma2_encoder_update(struct lzma2_encoder *lzma2,
+			 const uint8_t **in, const uint8_t *iend,
+			 uint8_t **out, uint8_t *oend,
+			 enum lzma_action action);
+/*
+ * Start the next chunk with lc, lp and pb of @props once all input given
+ * so far has been encoded, and drop the history if @dict_reset so that the
+ * rest can be decoded independently (all properties are used then). It's
+ * also how a new stream is started after the last one has been finished.
+ */
+int lzma2_encoder_reset(struct lzma2_encoder *lzma2,
+			const struct lzma_properties *props, bool dict_reset);
+void lzma2_encoder_end(struct lzma2_encoder *lzma2);
+
+/* the integrity check of each .xz block, in .xz check IDs */
+enum lzma_check {
+	LZMA_CHECK_NONE = 0,
+	LZMA_CHECK_CRC32 = 1,
+	LZMA_CHECK_CRC64 = 4,
+};
+
+struct lzma_xz_options {
+	enum lzma_check check;
+	/* uncompressed size of each block, 0 = max(3 * dictsize, 1MiB) */
+	uint32_t blocksize;
+};
+
+struct lzma_xz_encoder;
+
+int lzma_xz_encoder_init(struct lzma_xz_encoder **xzp,
+			 const struct lzma_properties *props,
+			 const struct lzma_xz_options *opts);
+/*
+ * The same as lzma_encoder_update(), but a .xz stream is written. Input is
+ * split into independent LZMA2 blocks, which have both sizes in the block
+ * headers and in the index at the end, so that readers can seek to a block
+ * or decompress blocks in parallel. A new stream can be started after the
+ * last one has been finished (LZMA_FINISH).
+ */
+int lzma_xz_encoder_update(struct lzma_xz_encoder *xz,
+			   const uint8_t **in, const uint8_t *iend,
+			   uint8_t **out, uint8_t *oend,
+			   enum lzma_action action);
+void lzma_xz_encoder_end(struct lzma_xz_encoder *xz);
+
+struct lzma_decoder;
+
+/* initialize a decoder from a .lzma (LZMA_Alone) header */
+int lzma_decoder_init(struct lzma_decoder **lzmap,
+		      const uint8_t header[LZMA_HEADER_SIZE]);
+int lzma_decoder_preset_dict(struct lzma_decoder *lzma,
+			     const uint8_t *dict, uint32_t size);
+
+/*
+ * Decompress [*in, iend) into [*out, oend) and advance *in and *out.
+ * The output buffer is always filled up before returning -ENOSPC even
+ * in the middle of a match, so it can be called for each fixed-size
+ * block (e.g. a page) one by one.
+ *
+ * Returns -ERANGE if more input is needed, -ENOSPC if the output buffer
+ * is full, 0 if the end of stream has been reached, or -EBADMSG if the
+ * input is corrupted.
+ */
+int lzma_decoder_update(struct lzma_decoder *lzma,
+			const uint8_t **in, const uint8_t *iend,
+			uint8_t **out, uint8_t *oend);
+void lzma_decoder_end(struct lzma_decoder *lzma);
+
+
+struct lzma_mt_options {
+	unsigned int threads;
+	/* uncompressed size of each block, 0 = max(3 * dictsize, 1MiB) */
+	uint32_t blocksize;
+	/* use the tail of the previous block as the preset dictionary */
+	bool preset_dict;
+};
+
+/* the header of each block emitted by the block-parallel encoder */
+#define LZMA_MT_BLOCK_HEADER_SIZE	8
+
+struct lzma_mt_encoder;
+
+int lzma_mt_encoder_init(struct lzma_mt_encoder **mtp,
+			 const struct lzma_properties *props,
+			 const struct lzma_mt_options *opts);
+
+/*
+ * The same as lzma_encoder_update(), but input is split into blocks which
+ * are compressed on a worker pool. Blocks are emitted in order, each of
+ * them is an uncompressed size (le32) and a compressed size (le32)
+ * followed by a LZMA stream with an end marker, which can be decoded by
+ * a decoder initialized with the .lzma header of the properties (and the
+ * preset dictionary of the previous block tail if preset_dict is on).
+ */
+int lzma_mt_encoder_update(struct lzma_mt_encoder *mt,
+			   const uint8_t **in, const uint8_t *iend,
+			   uint8_t **out, uint8_t *oend,
+			   enum lzma_action action);
+void lzma_mt_encoder_end(struct lzma_mt_encoder *mt);
+
+#endif
+
@@ -27,6 +27,20 @@ static inline uint32_t get_unaligned32(const void *ptr)
 	return unalign->v;
 }
 
+static inline uint64_t get_unaligned64(const void *ptr)
+{
+	const struct { uint64_t v; } __attribute__((packed)) *unalign = ptr;
+
+	return unalign->v;
+}
+
+static inline void put_unaligned32(uint32_t val, void *ptr)
+{
+	struct { uint32_t v; } __attribute__((packed)) *unalign = ptr;
+
+	unalign->v = val;
+}
+
 static inline unsigned int __is_little_endian(void)
 {
 #ifdef __LITTLE_ENDIAN
@@ -51,5 +65,30 @@ static inline uint32_t get_unaligned_le32(const void *ptr)
 	return get_unaligned32(ptr);
 }
 
+static inline uint64_t get_unaligned_le64(const void *ptr)
+{
+	if (!__is_little_endian()) {
+		const uint8_t *p = (const uint8_t *)ptr;
+
+		return get_unaligned_le32(p) |
+			((uint64_t)get_unaligned_le32(p + 4) << 32);
+	}
+	return get_unaligned64(ptr);
+}
+
+static inline void put_unaligned_le32(uint32_t val, void *ptr)
+{
+	if (!__is_little_endian()) {
+		uint8_t *p = (uint8_t *)ptr;
+
+		p[0] = val;
+		p[1] = val >> 8;
+		p[2] = val >> 16;
+		p[3] = val >> 24;
+		return;
+	}
+	put_unaligned32(val, ptr);
+}
+
 #endif
 
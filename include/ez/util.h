@@ -8,14 +8,120 @@
 #define __EZ_UTIL_H
 
 #include "defs.h"
+#include "unaligned.h"
 
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/* the byte offset of the first difference in a non-zero xor of two words */
+static inline unsigned int __ez_diffbyte(uint64_t diff)
+{
+	if (__is_little_endian())
+		return __builtin_ctzll(diff) >> 3;
+	return __builtin_clzll(diff) >> 3;
+}
+
+#if defined(__SSE2__)
+#define EZ_MEMCMP_SIMD
+
+static inline const uint8_t *__ez_memcmp_sse2(const uint8_t *buf1,
+					      const uint8_t *buf2,
+					      const uint8_t *buf1end)
+{
+	while (buf1end - buf1 >= 16) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)buf1);
+		const __m128i b = _mm_loadu_si128((const __m128i *)buf2);
+		const unsigned int mask =
+			_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xFFFF;
+
+		if (mask)
+			return buf1 + __builtin_ctz(mask);
+		buf1 += 16;
+		buf2 += 16;
+	}
+	return buf1;
+}
+
+/* AVX2 is only used if the CPU supports it, see __ez_memcmp_simd() */
+static inline __attribute__((target("avx2")))
+const uint8_t *__ez_memcmp_avx2(const uint8_t *buf1, const uint8_t *buf2,
+				const uint8_t *buf1end)
+{
+	while (buf1end - buf1 >= 32) {
+		const __m256i a = _mm256_loadu_si256((const __m256i *)buf1);
+		const __m256i b = _mm256_loadu_si256((const __m256i *)buf2);
+		const unsigned int mask =
+			~_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+		if (mask)
+			return buf1 + __builtin_ctz(mask);
+		buf1 += 32;
+		buf2 += 32;
+	}
+	return buf1;
+}
+
+/* stop at the first mismatch, or where less than 16 bytes are left */
+static inline const uint8_t *__ez_memcmp_simd(const uint8_t *buf1,
+					      const uint8_t *buf2,
+					      const uint8_t *buf1end)
+{
+#ifndef __AVX2__
+	if (__builtin_cpu_supports("avx2"))
+#endif
+	{
+		const uint8_t *end = __ez_memcmp_avx2(buf1, buf2, buf1end);
+
+		buf2 += end - buf1;
+		buf1 = end;
+	}
+	return __ez_memcmp_sse2(buf1, buf2, buf1end);
+}
+#endif
+
+/*
+ * Return the first mismatch of ptr1 and ptr2, or buf1end if they're the
+ * same all the way. Words are compared rather than bytes, and long runs
+ * (which are common in highly redundant data) go to SIMD if available.
+ */
 static inline const uint8_t *ez_memcmp(const void *ptr1, const void *ptr2,
 				       const void *buf1end)
 {
 	const uint8_t *buf1 = ptr1;
 	const uint8_t *buf2 = ptr2;
+	const uint8_t *end = buf1end;
+
+	/* most matches are short, so check the first word inline */
+	if (end - buf1 >= 8) {
+		const uint64_t diff = get_unaligned64(buf1) ^
+			get_unaligned64(buf2);
+
+		if (diff)
+			return buf1 + __ez_diffbyte(diff);
+		buf1 += 8;
+		buf2 += 8;
+
+#ifdef EZ_MEMCMP_SIMD
+		if (end - buf1 >= 16) {
+			const uint8_t *ret = __ez_memcmp_simd(buf1, buf2, end);
+
+			buf2 += ret - buf1;
+			buf1 = ret;
+		}
+#endif
+		while (end - buf1 >= 8) {
+			const uint64_t diff = get_unaligned64(buf1) ^
+				get_unaligned64(buf2);
+
+			if (diff)
+				return buf1 + __ez_diffbyte(diff);
+			buf1 += 8;
+			buf2 += 8;
+		}
+	}
 
-	for (; buf1 != buf1end; ++buf1, ++buf2)
+	for (; buf1 < end; ++buf1, ++buf2)
 		if (*buf1 != *buf2)
 			break;
 	return buf1;
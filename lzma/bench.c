@@ -0,0 +1,608 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/bench.c - LZMA encoder benchmark
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <ez/lzma.h>
+#include <ez/unaligned.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_MAX_LIST	16
+
+struct bench_input {
+	const char *name;
+	uint8_t *buf;
+	size_t size;
+};
+
+struct bench_config {
+	int level;
+	uint32_t dictsize;
+	/* 0 = a single stream, otherwise fixed-size clusters (destsize) */
+	uint32_t destsize;
+};
+
+/* what a child reports back to the parent for each configuration */
+struct bench_result {
+	int err;
+	uint64_t csize;
+	double best, median;	/* seconds */
+	uint64_t cycles;	/* of the best run, 0 if unknown */
+};
+
+static unsigned int runs = 5, warmups = 1;
+static const struct lzma_allocator *allocator;
+static bool threaded, adaptive;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* xorshift64*, so that synthetic corpora are the same for each run */
+static uint64_t bench_rand(uint64_t *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 0x2545F4914F6CDD1DULL;
+}
+
+/* words picked with a skewed distribution, which looks like text */
+static void gen_text(uint8_t *buf, size_t size, uint64_t *seed)
+{
+	static const char *const words[] = {
+		"the", "of", "and", "to", "in", "is", "that", "for", "it",
+		"extent", "path", "blocking", "delayed", "ref", "buffer",
+		"match", "finder", "literal", "distance", "probability",
+		"encoder", "decoder", "dictionary", "compression", "stream",
+	};
+	size_t pos = 0;
+
+	while (pos < size) {
+		const uint64_t r = bench_rand(seed);
+		/* the minimum of two picks prefers the first words */
+		unsigned int i = min(r % ARRAY_SIZE(words),
+				     (r >> 32) % ARRAY_SIZE(words));
+		const char *w = words[i];
+
+		while (*w && pos < size)
+			buf[pos++] = *w++;
+		if (pos < size)
+			buf[pos++] = (r >> 16) % 13 ? ' ' : '\n';
+	}
+}
+
+static int gen_input(struct bench_input *in, const char *name, size_t size)
+{
+	uint64_t seed = 0x9E3779B97F4A7C15ULL;
+	size_t i;
+
+	in->buf = malloc(size);
+	if (!in->buf)
+		return -ENOMEM;
+	in->name = name;
+	in->size = size;
+
+	if (!strcmp(name, "zero")) {
+		memset(in->buf, 0, size);
+	} else if (!strcmp(name, "random")) {
+		for (i = 0; i < size; ++i)
+			in->buf[i] = bench_rand(&seed) >> 56;
+	} else if (!strcmp(name, "text")) {
+		gen_text(in->buf, size, &seed);
+	} else if (!strcmp(name, "mixed")) {
+		/* 64KiB chunks of text, random and repeated data */
+		for (i = 0; i < size; i += 65536) {
+			const size_t n = min_t(size_t, 65536, size - i);
+			const uint64_t r = bench_rand(&seed);
+
+			if (r % 3 == 0) {
+				gen_text(in->buf + i, n, &seed);
+			} else if (r % 3 == 1) {
+				size_t j;
+
+				for (j = 0; j < n; ++j)
+					in->buf[i + j] = bench_rand(&seed);
+			} else {
+				size_t j;
+
+				for (j = 0; j < n; ++j)
+					in->buf[i + j] = "abcabd"[j % 6];
+			}
+		}
+	} else {
+		free(in->buf);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int load_input(struct bench_input *in, const char *file)
+{
+	size_t len = 0;
+	int fd, ret;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	in->buf = NULL;
+	do {
+		uint8_t *nbuf = realloc(in->buf, len + 65536);
+
+		if (!nbuf) {
+			close(fd);
+			free(in->buf);
+			return -ENOMEM;
+		}
+		in->buf = nbuf;
+		ret = read(fd, in->buf + len, 65536);
+		len += max(ret, 0);
+	} while (ret > 0);
+	close(fd);
+
+	in->name = file;
+	in->size = len;
+	return ret < 0 ? -errno : 0;
+}
+
+/* the compressed data, which is a stream or fixed-size clusters */
+struct bench_output {
+	uint8_t *buf;
+	size_t capacity;
+	uint64_t csize;
+
+	/* uncompressed size of each cluster */
+	uint32_t *usizes;
+	size_t nclusters, maxclusters;
+};
+
+static int bench_grow(struct bench_output *out, uint32_t destsize)
+{
+	const size_t n = max_t(size_t, 16, out->maxclusters << 1);
+	uint32_t *usizes = realloc(out->usizes, n * sizeof(*usizes));
+	uint8_t *buf;
+
+	if (!usizes)
+		return -ENOMEM;
+	out->usizes = usizes;
+
+	buf = realloc(out->buf, n * destsize);
+	if (!buf)
+		return -ENOMEM;
+	out->buf = buf;
+	out->capacity = n * destsize;
+	out->maxclusters = n;
+	return 0;
+}
+
+/* compress the whole input once */
+static int bench_encode(struct lzma_encoder *lzma,
+			const struct lzma_properties *props,
+			const struct bench_config *cfg,
+			const struct bench_input *in, struct bench_output *out)
+{
+	const uint8_t *ip = in->buf, *iend = in->buf + in->size;
+	uint8_t *op = out->buf;
+	int err;
+
+	out->nclusters = 0;
+	if (!cfg->destsize) {
+		err = lzma_encoder_reset(lzma, props);
+		if (err)
+			return err;
+		err = lzma_encoder_update(lzma, &ip, iend, &op,
+					  out->buf + out->capacity,
+					  LZMA_FINISH);
+		out->csize = LZMA_HEADER_SIZE + (op - out->buf);
+		return err;
+	}
+
+	while (ip < iend) {
+		uint32_t insize = min_t(size_t, iend - ip, UINT32_MAX);
+		int ret;
+
+		if (out->nclusters >= out->maxclusters) {
+			err = bench_grow(out, cfg->destsize);
+			if (err)
+				return err;
+		}
+
+		err = lzma_encoder_reset(lzma, props);
+		if (err)
+			return err;
+		/* the uncompressed size of each cluster is kept elsewhere */
+		ret = lzma_encoder_destsize(lzma, ip, &insize,
+				out->buf + out->nclusters * cfg->destsize,
+				cfg->destsize, false);
+		if (ret < 0)
+			return ret;
+		if (!insize)
+			return -ENOSPC;
+		ip += insize;
+		out->usizes[out->nclusters++] = insize;
+	}
+	/* clusters are stored in fixed-size blocks */
+	out->csize = out->nclusters * (uint64_t)cfg->destsize;
+	return 0;
+}
+
+/* decode what bench_encode() generated, and compare with the input */
+static int bench_verify(const struct lzma_properties *props,
+			const struct bench_config *cfg,
+			const struct bench_input *in,
+			const struct bench_output *out)
+{
+	uint8_t header[LZMA_HEADER_SIZE];
+	const uint8_t *ip = out->buf;
+	size_t pos = 0, i = 0;
+	uint8_t *dec;
+	int err;
+
+	/* one more byte, or the end marker isn't reached with a full buffer */
+	dec = malloc(in->size + 1);
+	if (!dec)
+		return -ENOMEM;
+
+	lzma_encoder_header(props, header);
+	do {
+		struct lzma_decoder *lzma;
+		const uint8_t *iend;
+		uint8_t *op = dec + pos;
+
+		if (cfg->destsize) {
+			put_unaligned_le32(out->usizes[i], header + 5);
+			put_unaligned_le32(0, header + 9);
+			iend = ip + cfg->destsize;
+		} else {
+			iend = ip + out->csize - LZMA_HEADER_SIZE;
+		}
+
+		err = lzma_decoder_init(&lzma, header);
+		if (err)
+			break;
+		err = lzma_decoder_update(lzma, &ip, iend, &op,
+					  dec + in->size + 1);
+		lzma_decoder_end(lzma);
+		pos = op - dec;
+		ip = iend;
+	} while (!err && ++i < out->nclusters);
+
+	if (!err && (pos != in->size || memcmp(dec, in->buf, pos)))
+		err = -EBADMSG;
+	free(dec);
+	return err;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	const double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_run(const struct bench_config *cfg,
+		      const struct bench_input *in, struct bench_result *res)
+{
+	struct bench_output out = {};
+	struct lzma_properties props;
+	struct lzma_encoder *lzma;
+	double *t = calloc(runs, sizeof(*t));
+	unsigned int i;
+
+	memset(res, 0, sizeof(*res));
+	lzma_default_properties(&props, cfg->level);
+	props.mf.dictsize = cfg->dictsize;
+	props.allocator = allocator;
+	props.mf.threaded = threaded;
+	if (adaptive) {
+		props.mf.nice_len_min = props.mf.nice_len >> 2;
+		props.mf.depth_min = props.mf.depth >> 2;
+	}
+
+	if (!cfg->destsize) {
+		out.capacity = in->size + (in->size >> 4) + 65536;
+		out.buf = malloc(out.capacity);
+	} else {
+		res->err = bench_grow(&out, cfg->destsize);
+	}
+	if (!t || !out.buf) {
+		res->err = -ENOMEM;
+		goto out;
+	}
+
+	res->err = lzma_encoder_init(&lzma, &props);
+	if (res->err)
+		goto out;
+
+	for (i = 0; i < warmups + runs; ++i) {
+		const double start = now();
+		const uint64_t c0 = cycles();
+		int err = bench_encode(lzma, &props, cfg, in, &out);
+		const uint64_t c1 = cycles();
+		const double elapsed = now() - start;
+
+		if (err) {
+			res->err = err;
+			break;
+		}
+		if (i < warmups)
+			continue;
+		t[i - warmups] = elapsed;
+		if (i == warmups || elapsed < res->best) {
+			res->best = elapsed;
+			res->cycles = c1 - c0;
+		}
+	}
+	lzma_encoder_end(lzma);
+
+	if (!res->err) {
+		qsort(t, runs, sizeof(*t), cmp_double);
+		res->median = t[runs / 2];
+		res->csize = out.csize;
+		res->err = bench_verify(&props, cfg, in, &out);
+	}
+out:
+	free(out.usizes);
+	free(out.buf);
+	free(t);
+}
+
+/*
+ * Run a configuration in a child process, so that peak RSS is only of the
+ * configuration itself and a crash doesn't stop the whole benchmark.
+ */
+static int bench_fork(const struct bench_config *cfg,
+		      const struct bench_input *in, struct bench_result *res,
+		      long *maxrss)
+{
+	struct rusage ru;
+	int fds[2], status;
+	pid_t pid;
+
+	if (pipe(fds))
+		return -errno;
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+	if (!pid) {
+		close(fds[0]);
+		bench_run(cfg, in, res);
+		_exit(write(fds[1], res, sizeof(*res)) != sizeof(*res));
+	}
+	close(fds[1]);
+	if (read(fds[0], res, sizeof(*res)) != sizeof(*res))
+		res->err = -EPIPE;
+	close(fds[0]);
+
+	if (wait4(pid, &status, 0, &ru) < 0)
+		return -errno;
+	*maxrss = ru.ru_maxrss;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return -ECHILD;
+	return 0;
+}
+
+/* parse a comma separated list with optional K/M suffixes */
+static int parse_list(const char *s, uint32_t *list)
+{
+	int n = 0;
+
+	while (*s && n < BENCH_MAX_LIST) {
+		char *end;
+		unsigned long v = strtoul(s, &end, 0);
+
+		if (end == s)
+			return -EINVAL;
+		if (*end == 'K' || *end == 'k')
+			v <<= 10, ++end;
+		else if (*end == 'M' || *end == 'm')
+			v <<= 20, ++end;
+		list[n++] = v;
+		if (*end != ',')
+			return *end ? -EINVAL : n;
+		s = end + 1;
+	}
+	return n;
+}
+
+/* a JSON string with quotes, backslashes and control characters escaped */
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; ++s) {
+		const unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bench [options] [files...]\n"
+		" -l levels     comma separated levels (default 1,5,9)\n"
+		" -d dictsizes  dictionary sizes (default 64K,1M)\n"
+		" -c capacities destsize capacities, 0 = a single stream "
+		"(default 0,4096)\n"
+		" -r runs       measured runs of each configuration (default 5)\n"
+		" -w warmups    runs before measuring (default 1)\n"
+		" -s size       size of synthetic corpora (default 1M)\n"
+		" -o file       write results as JSON lines to file\n"
+		" -H            allocate tables with transparent huge pages\n"
+		" -P            find matches on a pipelined thread\n"
+		" -A            adapt depth and nice_len down to a quarter\n"
+		"without files, synthetic corpora zero, text, mixed and random "
+		"are used.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *const synthetic[] = {
+		"zero", "text", "mixed", "random",
+	};
+	uint32_t levels[BENCH_MAX_LIST] = { 1, 5, 9 };
+	uint32_t dictsizes[BENCH_MAX_LIST] = { 65536, 1 << 20 };
+	uint32_t capacities[BENCH_MAX_LIST] = { 0, 4096 };
+	int nlevels = 3, ndictsizes = 2, ncapacities = 2;
+	uint32_t synsize = 1 << 20;
+	FILE *json = NULL;
+	int opt, ninputs, i, l, d, c, failed = 0;
+
+	while ((opt = getopt(argc, argv, "l:d:c:r:w:s:o:HPAh")) != -1) {
+		uint32_t v[BENCH_MAX_LIST];
+
+		switch (opt) {
+		case 'l':
+			nlevels = parse_list(optarg, levels);
+			break;
+		case 'd':
+			ndictsizes = parse_list(optarg, dictsizes);
+			break;
+		case 'c':
+			ncapacities = parse_list(optarg, capacities);
+			break;
+		case 'r':
+		case 'w':
+		case 's':
+			if (parse_list(optarg, v) != 1)
+				goto err_usage;
+			if (opt == 'r')
+				runs = max(v[0], 1U);
+			else if (opt == 'w')
+				warmups = v[0];
+			else
+				synsize = v[0];
+			break;
+		case 'o':
+			json = fopen(optarg, "w");
+			if (!json) {
+				perror("fopen");
+				return 1;
+			}
+			break;
+		case 'H':
+			allocator = &lzma_hugepage_allocator;
+			break;
+		case 'P':
+			threaded = true;
+			break;
+		case 'A':
+			adaptive = true;
+			break;
+		default:
+			goto err_usage;
+		}
+		if (nlevels <= 0 || ndictsizes <= 0 || ncapacities <= 0)
+			goto err_usage;
+	}
+
+	ninputs = optind < argc ? argc - optind : ARRAY_SIZE(synthetic);
+	fprintf(stderr, "%-24s %5s %8s %6s %8s %7s %8s %8s %8s %9s\n",
+		"input", "level", "dict", "dest", "size", "ratio", "MB/s",
+		"median", "cyc/B", "rss(KiB)");
+
+	for (i = 0; i < ninputs; ++i) {
+		struct bench_input in = {};
+		int err;
+
+		if (optind < argc)
+			err = load_input(&in, argv[optind + i]);
+		else
+			err = gen_input(&in, synthetic[i], synsize);
+		if (err) {
+			fprintf(stderr, "failed to load input %d: %d\n", i, err);
+			return 1;
+		}
+
+		for (l = 0; l < nlevels; ++l)
+		for (d = 0; d < ndictsizes; ++d)
+		for (c = 0; c < ncapacities; ++c) {
+			const struct bench_config cfg = {
+				.level = levels[l],
+				.dictsize = dictsizes[d],
+				.destsize = capacities[c],
+			};
+			struct bench_result res;
+			const double mb = in.size / 1e6;
+			long maxrss = 0;
+
+			err = bench_fork(&cfg, &in, &res, &maxrss);
+			if (!err)
+				err = res.err;
+			if (err) {
+				fprintf(stderr, "%-24s %5d %8u %6u failed: %d\n",
+					in.name, cfg.level, cfg.dictsize,
+					cfg.destsize, err);
+				failed = 1;
+				continue;
+			}
+
+			fprintf(stderr,
+				"%-24s %5d %8u %6u %8llu %7.3f %8.2f %8.2f %8.2f %9ld\n",
+				in.name, cfg.level, cfg.dictsize, cfg.destsize,
+				(unsigned long long)res.csize,
+				(double)in.size / res.csize,
+				mb / res.best, mb / res.median,
+				(double)res.cycles / in.size, maxrss);
+
+			if (!json)
+				continue;
+			fputs("{\"input\":", json);
+			json_string(json, in.name);
+			fprintf(json,
+				",\"size\":%zu,\"level\":%d,"
+				"\"dictsize\":%u,\"destsize\":%u,"
+				"\"runs\":%u,\"warmups\":%u,"
+				"\"csize\":%llu,\"ratio\":%.4f,"
+				"\"mbps_best\":%.3f,\"mbps_median\":%.3f,"
+				"\"cycles_per_byte\":%.3f,"
+				"\"peak_rss_kib\":%ld}\n",
+				in.size, cfg.level, cfg.dictsize,
+				cfg.destsize, runs, warmups,
+				(unsigned long long)res.csize,
+				(double)in.size / res.csize,
+				mb / res.best, mb / res.median,
+				(double)res.cycles / in.size, maxrss);
+		}
+		free(in.buf);
+	}
+	if (json)
+		fclose(json);
+	return failed;
+
+err_usage:
+	usage();
+	return 1;
+}
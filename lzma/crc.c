@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/crc.c - CRC32 and CRC64 (ECMA-182) of .xz
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ *
+ * Both are slicing-by-8: table k gives the CRC of a byte followed by k
+ * zero bytes, so that 8 bytes are folded with 8 independent lookups
+ * instead of a chain of 8 dependent ones.
+ */
+#include <pthread.h>
+#include <ez/unaligned.h>
+#include "crc.h"
+#include "bytehash.h"	/* crc32_byte_hashtable, the table for one byte */
+
+#define CRC64_POLY	0xC96C5795D7870F42ULL
+
+static uint32_t crc32_table[8][256];
+static uint64_t crc64_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_tables_init(void)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < 256; ++i) {
+		uint64_t r = i;
+
+		for (k = 0; k < 8; ++k)
+			r = (r >> 1) ^ (CRC64_POLY & -(r & 1));
+		crc32_table[0][i] = crc32_byte_hashtable[i];
+		crc64_table[0][i] = r;
+	}
+
+	for (k = 1; k < 8; ++k) {
+		for (i = 0; i < 256; ++i) {
+			const uint32_t r32 = crc32_table[k - 1][i];
+			const uint64_t r64 = crc64_table[k - 1][i];
+
+			crc32_table[k][i] = (r32 >> 8) ^ crc32_table[0][r32 & 0xFF];
+			crc64_table[k][i] = (r64 >> 8) ^ crc64_table[0][r64 & 0xFF];
+		}
+	}
+}
+
+void lzma_crc_init(void)
+{
+	pthread_once(&crc_once, crc_tables_init);
+}
+
+uint32_t lzma_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	crc = ~crc;
+	for (; len && ((uintptr_t)p & 7); --len)
+		crc = crc32_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		const uint32_t lo = get_unaligned_le32(p) ^ crc;
+		const uint32_t hi = get_unaligned_le32(p + 4);
+
+		crc = crc32_table[7][lo & 0xFF] ^
+			crc32_table[6][(lo >> 8) & 0xFF] ^
+			crc32_table[5][(lo >> 16) & 0xFF] ^
+			crc32_table[4][lo >> 24] ^
+			crc32_table[3][hi & 0xFF] ^
+			crc32_table[2][(hi >> 8) & 0xFF] ^
+			crc32_table[1][(hi >> 16) & 0xFF] ^
+			crc32_table[0][hi >> 24];
+	}
+
+	for (; len; --len)
+		crc = crc32_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+uint64_t lzma_crc64(uint64_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	crc = ~crc;
+	for (; len && ((uintptr_t)p & 7); --len)
+		crc = crc64_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		const uint64_t v = get_unaligned_le64(p) ^ crc;
+
+		crc = crc64_table[7][v & 0xFF] ^
+			crc64_table[6][(v >> 8) & 0xFF] ^
+			crc64_table[5][(v >> 16) & 0xFF] ^
+			crc64_table[4][(v >> 24) & 0xFF] ^
+			crc64_table[3][(v >> 32) & 0xFF] ^
+			crc64_table[2][(v >> 40) & 0xFF] ^
+			crc64_table[1][(v >> 48) & 0xFF] ^
+			crc64_table[0][v >> 56];
+	}
+
+	for (; len; --len)
+		crc = crc64_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/crc.h - CRC32 and CRC64 (ECMA-182) of .xz
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#ifndef __EZ_LZMA_CRC_H
+#define __EZ_LZMA_CRC_H
+
+#include <ez/defs.h>
+
+/* build the slicing tables, which must be called once before use */
+void lzma_crc_init(void);
+
+/* update @crc (0 for the initial value) with [buf, buf + len) */
+uint32_t lzma_crc32(uint32_t crc, const void *buf, size_t len);
+uint64_t lzma_crc64(uint64_t crc, const void *buf, size_t len);
+
+#endif
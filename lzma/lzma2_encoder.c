@@ -0,0 +1,313 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/lzma2_encoder.c - LZMA2 chunk writer
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#include <stdlib.h>
+#include "lzma_encoder.h"
+#include "rc_price.h"
+
+/* the compressed size of a chunk and the size of an uncompressed chunk */
+#define LZMA2_CHUNK_MAX			(1U << 16)
+#define LZMA2_UNCOMPRESSED_MAX		(1U << 21)
+#define LZMA2_HEADER_MAX		6
+#define LZMA2_LCLP_MAX			4
+
+/*
+ * Once a chunk turns out incompressible, the next 1, 2, 4... chunks are
+ * stored without being encoded at all before LZMA is tried again, unless
+ * one of them looks compressible by its byte frequencies.
+ */
+#define LZMA2_RAW_SKIP_MAX		8
+
+enum lzma2_reset {
+	LZMA2_RESET_NONE,
+	LZMA2_RESET_STATE,	/* new lc, lp and pb */
+	LZMA2_RESET_DICT,
+};
+
+struct lzma2_encoder {
+	struct lzma_encoder *lzma;
+	/* lc, lp and pb of the current chunks */
+	struct lzma_properties props;
+
+	/* requested by lzma2_encoder_reset() and the properties for it */
+	enum lzma2_reset reset;
+	struct lzma_properties next;
+
+	/* what the next chunk header should tell the decoder */
+	bool need_dict_reset, need_props, need_state_reset;
+
+	/* a LZMA chunk has been started, and the end of stream is written */
+	bool chunking, ended;
+	unsigned int rawskip, rawprobe;
+
+	/* the header and data of the chunk being written out */
+	uint32_t outpos, outsize;
+	uint8_t buf[LZMA2_HEADER_MAX + LZMA2_CHUNK_MAX];
+};
+
+static void lzma2_write_raw(struct lzma2_encoder *lzma2,
+			    const uint8_t *data, uint32_t usize)
+{
+	uint8_t *h = lzma2->buf;
+
+	/* 1: uncompressed with a dictionary reset, 2: without */
+	h[0] = lzma2->need_dict_reset ? 1 : 2;
+	h[1] = (usize - 1) >> 8;
+	h[2] = usize - 1;
+	memcpy(h + 3, data, usize);
+	lzma2->outpos = 0;
+	lzma2->outsize = 3 + usize;
+
+	/* the state has been updated by the data which is thrown away */
+	lzma2->need_dict_reset = false;
+	lzma2->need_state_reset = true;
+}
+
+/* if the order-0 entropy of the data is under 7 bits per byte */
+static bool lzma2_looks_compressible(const uint8_t *data, uint32_t size)
+{
+	uint32_t freq[256] = { 0 }, i;
+	uint64_t price = 0;
+
+	for (i = 0; i < size; ++i)
+		++freq[data[i]];
+
+	for (i = 0; i < 256; ++i) {
+		const uint32_t slot = (uint64_t)freq[i] *
+			RC_PRICE_TABLE_SIZE / size;
+
+		price += (uint64_t)freq[i] *
+			rc_prices[min_t(uint32_t, slot, RC_PRICE_TABLE_SIZE - 1)];
+	}
+	return price < (uint64_t)size * 7 << RC_BIT_PRICE_SHIFT_BITS;
+}
+
+static void lzma2_write_chunk(struct lzma2_encoder *lzma2, uint32_t csize,
+			      const uint8_t *data, uint32_t usize)
+{
+	const struct lzma_properties *p = &lzma2->props;
+	uint8_t control, *h;
+
+	if (csize >= usize) {
+		lzma2_write_raw(lzma2, data, usize);
+		lzma2->rawprobe = min_t(unsigned int, LZMA2_RAW_SKIP_MAX,
+					lzma2->rawprobe ? lzma2->rawprobe << 1 : 1);
+		lzma2->rawskip = lzma2->rawprobe;
+		return;
+	}
+	lzma2->rawprobe = 0;
+
+	/* bit 5-6: 0 = no reset, 1 = state, 2 = state + props, 3 = all */
+	control = 0x80 | ((usize - 1) >> 16);
+	if (lzma2->need_dict_reset)
+		control |= 3 << 5;
+	else if (lzma2->need_props)
+		control |= 2 << 5;
+	else if (lzma2->need_state_reset)
+		control |= 1 << 5;
+
+	/* the data has been encoded after the space for the longest header */
+	h = lzma2->buf + LZMA2_HEADER_MAX - (control >= 0xC0 ? 6 : 5);
+	lzma2->outpos = h - lzma2->buf;
+	lzma2->outsize = LZMA2_HEADER_MAX + csize;
+
+	h[0] = control;
+	h[1] = (usize - 1) >> 8;
+	h[2] = usize - 1;
+	h[3] = (csize - 1) >> 8;
+	h[4] = csize - 1;
+	if (control >= 0xC0)
+		h[5] = (p->pb * 5 + p->lp) * 9 + p->lc;
+
+	lzma2->need_dict_reset = lzma2->need_props =
+		lzma2->need_state_reset = false;
+}
+
+static int lzma2_begin_chunk(struct lzma2_encoder *lzma2)
+{
+	const uint32_t dictsize = lzma2->props.mf.dictsize;
+	int err;
+
+	/* raw chunks are taken from the window, which can't be larger */
+	const uint32_t ulimit = dictsize < LZMA2_CHUNK_MAX ?
+		dictsize : LZMA2_UNCOMPRESSED_MAX;
+
+	if (lzma2->need_state_reset && !lzma2->need_dict_reset) {
+		err = lzma_encoder_reset_state(lzma2->lzma, &lzma2->props);
+		if (err)
+			return err;
+	}
+
+	lzma_encoder_chunk_begin(lzma2->lzma, lzma2->buf + LZMA2_HEADER_MAX,
+				 LZMA2_CHUNK_MAX, ulimit);
+	lzma2->chunking = true;
+	return 0;
+}
+
+static int lzma2_apply_reset(struct lzma2_encoder *lzma2)
+{
+	int err;
+
+	if (lzma2->reset == LZMA2_RESET_DICT) {
+		err = lzma_encoder_reset(lzma2->lzma, &lzma2->next);
+		if (err)
+			return err;
+		lzma2->props = lzma2->next;
+		lzma2->need_dict_reset = true;
+		lzma2->rawskip = lzma2->rawprobe = 0;
+		lzma2->ended = false;
+	} else {
+		/* applied by lzma2_begin_chunk() */
+		lzma2->props.lc = lzma2->next.lc;
+		lzma2->props.lp = lzma2->next.lp;
+		lzma2->props.pb = lzma2->next.pb;
+		lzma2->need_state_reset = true;
+	}
+	lzma2->need_props = true;
+	lzma2->reset = LZMA2_RESET_NONE;
+	return 0;
+}
+
+int lzma2_encoder_update(struct lzma2_encoder *lzma2,
+			 const uint8_t **in, const uint8_t *iend,
+			 uint8_t **out, uint8_t *oend,
+			 enum lzma_action action)
+{
+	while (1) {
+		const uint8_t *data, *ie = iend;
+		uint32_t csize, usize;
+		bool finish;
+		int ret;
+
+		if (lzma2->outpos < lzma2->outsize) {
+			const uint32_t n = min_t(size_t, oend - *out,
+						 lzma2->outsize - lzma2->outpos);
+
+			memcpy(*out, lzma2->buf + lzma2->outpos, n);
+			*out += n;
+			lzma2->outpos += n;
+			if (lzma2->outpos < lzma2->outsize)
+				return -ENOSPC;
+		}
+
+		if (lzma2->ended) {
+			if (lzma2->reset == LZMA2_RESET_NONE)
+				return 0;
+			ret = lzma2_apply_reset(lzma2);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		/* encode all input given before the reset first */
+		if (lzma2->reset) {
+			ie = *in;
+			finish = true;
+		} else {
+			finish = (action == LZMA_FINISH);
+		}
+
+		if (lzma2->rawskip) {
+			ret = lzma_encoder_chunk_peek(lzma2->lzma, in, ie,
+						      finish, LZMA2_CHUNK_MAX,
+						      &data, &usize);
+			if (ret < 0)
+				return ret;
+
+			/* try LZMA again right away if it's worth it */
+			if (usize && lzma2_looks_compressible(data, usize)) {
+				lzma2->rawskip = lzma2->rawprobe = 0;
+				continue;
+			}
+
+			ret = lzma_encoder_chunk_raw(lzma2->lzma, in, ie,
+						     finish, LZMA2_CHUNK_MAX,
+						     &data, &usize);
+			if (ret >= 0 && usize) {
+				lzma2_write_raw(lzma2, data, usize);
+				--lzma2->rawskip;
+			}
+		} else {
+			if (!lzma2->chunking) {
+				ret = lzma2_begin_chunk(lzma2);
+				if (ret)
+					return ret;
+			}
+
+			ret = lzma_encoder_chunk(lzma2->lzma, in, ie, finish,
+						 &csize, &data, &usize);
+			if (ret >= 0) {
+				lzma2->chunking = false;
+				if (usize)
+					lzma2_write_chunk(lzma2, csize,
+							  data, usize);
+			}
+		}
+
+		if (ret < 0)
+			return ret;
+		/* write it out, and see if anything is left next time */
+		if (usize)
+			continue;
+
+		/* all input so far has been encoded */
+		if (lzma2->reset) {
+			ret = lzma2_apply_reset(lzma2);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		lzma2->buf[0] = 0x00;	/* end of stream */
+		lzma2->outpos = 0;
+		lzma2->outsize = 1;
+		lzma2->ended = true;
+	}
+}
+
+int lzma2_encoder_reset(struct lzma2_encoder *lzma2,
+			const struct lzma_properties *props, bool dict_reset)
+{
+	if (props->lc + props->lp > LZMA2_LCLP_MAX)
+		return -EINVAL;
+
+	lzma2->next = *props;
+	if (dict_reset || lzma2->ended || lzma2->reset == LZMA2_RESET_DICT)
+		lzma2->reset = LZMA2_RESET_DICT;
+	else
+		lzma2->reset = LZMA2_RESET_STATE;
+	return 0;
+}
+
+int lzma2_encoder_init(struct lzma2_encoder **lzma2p,
+		       const struct lzma_properties *props)
+{
+	struct lzma2_encoder *lzma2;
+	int err;
+
+	if (props->lc + props->lp > LZMA2_LCLP_MAX)
+		return -EINVAL;
+
+	lzma2 = calloc(1, sizeof(*lzma2));
+	if (!lzma2)
+		return -ENOMEM;
+
+	err = lzma_encoder_init(&lzma2->lzma, props);
+	if (err) {
+		free(lzma2);
+		return err;
+	}
+	lzma2->props = *props;
+	lzma2->need_dict_reset = lzma2->need_props = true;
+	*lzma2p = lzma2;
+	return 0;
+}
+
+void lzma2_encoder_end(struct lzma2_encoder *lzma2)
+{
+	lzma_encoder_end(lzma2->lzma);
+	free(lzma2);
+}
@@ -1,6 +1,6 @@
 /* SPDX-License-Identifier: Unlicense */
 /*
- * lzma/lzma_common.h - Private definitions of LZMA encoder
+ * lzma/lzma_common.h - Private definitions of LZMA encoder and decoder
  *
  * Copyright (C) 2019 Gao Xiang <hsiangkao@aol.com>
  ×
@@ -85,6 +85,58 @@ enum lzma_lzma_state {
 
 #define MARK_LIT ((uint32_t)-1)
 
+/*
+ * Model constants shared by the encoder and the decoder, the names
+ * refer to lzma-specification.txt
+ */
+#define kNumBitModelTotalBits	11
+#define kBitModelTotal		(1 << kNumBitModelTotalBits)
+#define kProbInitValue		(kBitModelTotal >> 1)
+
+#define kNumStates		12
+#define LZMA_PB_MAX		4
+#define LZMA_NUM_PB_STATES_MAX	(1 << LZMA_PB_MAX)
+
+#define kLenNumLowBits		3
+#define kLenNumLowSymbols	(1 << kLenNumLowBits)
+#define kLenNumHighBits		8
+#define kLenNumHighSymbols	(1 << kLenNumHighBits)
+
+#define kNumLenToPosStates	4
+#define kNumPosSlotBits		6
+
+#define kStartPosModelIndex	4
+#define kEndPosModelIndex	14
+#define kNumFullDistances	(1 << (kEndPosModelIndex >> 1))
+
+#define kNumAlignBits		4
+#define kAlignTableSize		(1 << kNumAlignBits)
+#define kAlignMask		(kAlignTableSize - 1)
+
+#define kMatchMinLen		MATCH_LEN_MIN
+
+#define is_literal_state(state) ((state) < 7)
+
+static const unsigned char kLiteralNextStates[] =
+	{0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 4, 5};
+
+#define update_literal(state)	((state) = kLiteralNextStates[state])
+#define update_match(state)	((state) = is_literal_state(state) ? \
+				 STATE_LIT_MATCH : STATE_NONLIT_MATCH)
+#define update_long_rep(state)	((state) = is_literal_state(state) ? \
+				 STATE_LIT_LONGREP : STATE_NONLIT_REP)
+#define update_short_rep(state)	((state) = is_literal_state(state) ? \
+				 STATE_LIT_SHORTREP : STATE_NONLIT_REP)
+
+/* aka. GetLenToPosState in LZMA */
+static inline unsigned int get_len_state(unsigned int len)
+{
+	if (len < kNumLenToPosStates - 1 + kMatchMinLen)
+		return len - kMatchMinLen;
+
+	return kNumLenToPosStates - 1;
+}
+
 /*
  * LZMA_REQUIRED_INPUT_MAX = number of required input bytes for worst case.
  * Num bits = log2((2^11 / 31) ^ 22) + 26 < 134 + 26 = 160;
@@ -0,0 +1,591 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/lzma_decoder.c
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#include <stdlib.h>
+#include <ez/lzma.h>
+#include "lzma_common.h"
+#include "rc_decoder.h"
+
+/* the smallest dictionary to allocate, the same as LZMA SDK */
+#define LZMA_DICT_MIN		4096
+
+struct lzma_length_decoder {
+	/* choice, choice2 and low / mid bittrees, see length() of encoder */
+	probability low[LZMA_NUM_PB_STATES_MAX << (kLenNumLowBits + 1)];
+	probability high[kLenNumHighSymbols];
+};
+
+struct lzma_decoder {
+	struct lzma_rc_decoder rc;
+	bool rc_inited;
+
+	/* the sliding window, which is also the history of the output */
+	struct {
+		uint8_t *buf;
+		/* the next byte to write, and the number of valid bytes */
+		uint32_t pos, full;
+		uint32_t size;
+	} dict;
+	/* the dictionary size in the header, which limits preset dictionary */
+	uint32_t dictsize;
+
+	/* the uncompressed position, only the low bits are used */
+	uint32_t position;
+	/* the remaining uncompressed size, or UINT64_MAX if unknown */
+	uint64_t uncompressed;
+
+	/* the bytes of the current match which are still to be copied */
+	uint32_t remain_len;
+	/* the end of payload marker has been decoded */
+	bool eos;
+
+	enum lzma_lzma_state state;
+
+	/* the four most recent match distances */
+	uint32_t reps[LZMA_NUM_REPS];
+
+	unsigned int pbMask, lpMask;
+
+	unsigned int lc;
+
+	/* the following names refer to lzma-specificatin.txt */
+	probability isMatch[kNumStates][LZMA_NUM_PB_STATES_MAX];
+	probability isRep[kNumStates];
+	probability isRepG0[kNumStates];
+	probability isRepG1[kNumStates];
+	probability isRepG2[kNumStates];
+	probability isRep0Long[kNumStates][LZMA_NUM_PB_STATES_MAX];
+
+	probability posSlotDecoder[kNumLenToPosStates][1 << kNumPosSlotBits];
+	probability posDecoders[kNumFullDistances];
+	probability posAlignDecoder[1 << kNumAlignBits];
+
+	probability *literal;
+
+	struct lzma_length_decoder lenDecoder;
+	struct lzma_length_decoder repLenDecoder;
+
+	/* the input kept across calls when a symbol cannot be decoded yet */
+	unsigned int tempsize;
+	uint8_t temp[LZMA_REQUIRED_INPUT_MAX];
+};
+
+/* get the byte at 1-based distance @dist */
+static inline uint8_t dict_get(const struct lzma_decoder *lzma, uint32_t dist)
+{
+	const uint32_t pos = lzma->dict.pos;
+
+	return lzma->dict.buf[pos - dist + (dist > pos ? lzma->dict.size : 0)];
+}
+
+static inline bool dict_is_distance_valid(const struct lzma_decoder *lzma,
+					  uint32_t dist)
+{
+	return dist <= max(lzma->dict.full, lzma->dict.pos);
+}
+
+static inline void dict_put(struct lzma_decoder *lzma, uint8_t byte)
+{
+	lzma->dict.buf[lzma->dict.pos++] = byte;
+	++lzma->position;
+}
+
+/* copy the current match up to @limit, the rest is left in remain_len */
+static inline void dict_repeat(struct lzma_decoder *lzma, uint32_t limit)
+{
+	const uint32_t dist = lzma->reps[0];
+	uint8_t *const buf = lzma->dict.buf;
+	uint32_t pos = lzma->dict.pos;
+	uint32_t len = min(lzma->remain_len, limit - pos);
+	uint32_t back = pos - dist + (dist > pos ? lzma->dict.size : 0);
+
+	DBG_BUGON(!len);
+	lzma->remain_len -= len;
+	lzma->position += len;
+	lzma->dict.pos = pos + len;
+
+	if (dist <= pos && dist >= len) {
+		memcpy(buf + pos, buf + back, len);
+		return;
+	}
+
+	do {
+		buf[pos++] = buf[back++];
+		if (back == lzma->dict.size)
+			back = 0;
+	} while (--len);
+}
+
+static probability *literal_probs(struct lzma_decoder *lzma)
+{
+	const uint8_t prev_byte = dict_get(lzma, 1);
+
+	return lzma->literal + 3 * ((((lzma->position << 8) + prev_byte) &
+				     lzma->lpMask) << lzma->lc);
+}
+
+/* LenDecoder.Decode */
+static __always_inline uint32_t length(struct lzma_rc_decoder *rc,
+				       struct lzma_length_decoder *ld,
+				       const uint32_t pos_state,
+				       const bool dry)
+{
+	probability *probs = ld->low;
+
+	if (!rc_decode_bit(rc, probs, dry))
+		return kMatchMinLen +
+			rc_decode_bittree(rc, probs +
+					  (pos_state << (kLenNumLowBits + 1)),
+					  kLenNumLowBits, dry);
+
+	probs += kLenNumLowSymbols;
+	if (!rc_decode_bit(rc, probs, dry))
+		return kMatchMinLen + kLenNumLowSymbols +
+			rc_decode_bittree(rc, probs +
+					  (pos_state << (kLenNumLowBits + 1)),
+					  kLenNumLowBits, dry);
+
+	return kMatchMinLen + kLenNumLowSymbols * 2 /* + kLenNumMidSymbols */ +
+		rc_decode_bittree(rc, ld->high, kLenNumHighBits, dry);
+}
+
+/* returns a zero-based distance, UINT32_MAX stands for the end marker */
+static __always_inline uint32_t distance(struct lzma_decoder *lzma,
+					 struct lzma_rc_decoder *rc,
+					 const uint32_t len, const bool dry)
+{
+	const uint32_t posSlot =
+		rc_decode_bittree(rc, lzma->posSlotDecoder[get_len_state(len)],
+				  kNumPosSlotBits, dry);
+	uint32_t footer_bits, base;
+
+	if (posSlot < kStartPosModelIndex)
+		return posSlot;
+
+	footer_bits = (posSlot >> 1) - 1;
+	base = (2 | (posSlot & 1)) << footer_bits;
+
+	/* the same probability layout as match() of the encoder */
+	if (posSlot < kEndPosModelIndex)
+		return base + rc_decode_bittree_reverse(rc,
+				lzma->posDecoders + base, footer_bits, dry);
+
+	base = rc_decode_direct(rc, 2 | (posSlot & 1),
+				footer_bits - kNumAlignBits, dry);
+	return (base << kNumAlignBits) +
+		rc_decode_bittree_reverse(rc, lzma->posAlignDecoder,
+					  kNumAlignBits, dry);
+}
+
+/*
+ * Decode one LZMA symbol. If @dry is true, nothing but @rc is changed,
+ * which is used to check whether the symbol is complete in the input.
+ * Otherwise, the literal or the match (up to @limit) is put in the window.
+ */
+static __always_inline int lzma_decode_symbol(struct lzma_decoder *lzma,
+					      struct lzma_rc_decoder *rc,
+					      const uint32_t limit,
+					      const bool dry)
+{
+	const uint32_t pos_state = lzma->position & lzma->pbMask;
+	const unsigned int state = lzma->state;
+	uint32_t len;
+
+	if (!rc_decode_bit(rc, &lzma->isMatch[state][pos_state], dry)) {
+		probability *probs = literal_probs(lzma);
+		uint32_t symbol;
+
+		if (is_literal_state(state)) {
+			symbol = rc_decode_bittree(rc, probs, 8, dry);
+		} else {
+			/* see rc_encode_literal() of the encoder */
+			uint32_t match_byte = dict_get(lzma, lzma->reps[0]);
+			uint32_t offset = 0x100;
+
+			symbol = 1;
+			do {
+				const uint32_t match_bit =
+					(match_byte <<= 1) & offset;
+				const uint32_t bit = rc_decode_bit(rc,
+					&probs[offset + match_bit + symbol],
+					dry);
+
+				symbol = (symbol << 1) | bit;
+				offset &= bit ? match_bit : ~match_bit;
+			} while (symbol < 0x100);
+		}
+
+		if (!dry) {
+			dict_put(lzma, symbol);
+			update_literal(lzma->state);
+		}
+		return 0;
+	}
+
+	if (!rc_decode_bit(rc, &lzma->isRep[state], dry)) {
+		uint32_t dist;
+
+		len = length(rc, &lzma->lenDecoder, pos_state, dry);
+		dist = distance(lzma, rc, len, dry);
+		if (dist == UINT32_MAX) {
+			/* the last byte of rc_flush(), then code should be 0 */
+			rc_normalize(rc, dry);
+			if (dry)
+				return 0;
+			lzma->eos = true;
+			return rc->code ? -EBADMSG : 0;
+		}
+		if (dry)
+			return 0;
+
+		update_match(lzma->state);
+		lzma->reps[3] = lzma->reps[2];
+		lzma->reps[2] = lzma->reps[1];
+		lzma->reps[1] = lzma->reps[0];
+		lzma->reps[0] = dist + 1;
+	} else {
+		if (!rc_decode_bit(rc, &lzma->isRepG0[state], dry)) {
+			if (!rc_decode_bit(rc, &lzma->isRep0Long[state][pos_state],
+					   dry)) {
+				/* short rep */
+				if (dry)
+					return 0;
+				if (!dict_is_distance_valid(lzma,
+							    lzma->reps[0]))
+					return -EBADMSG;
+				update_short_rep(lzma->state);
+				dict_put(lzma, dict_get(lzma, lzma->reps[0]));
+				return 0;
+			}
+		} else {
+			uint32_t rep = 1, dist;
+
+			if (rc_decode_bit(rc, &lzma->isRepG1[state], dry))
+				rep += 1 + rc_decode_bit(rc,
+						&lzma->isRepG2[state], dry);
+
+			if (!dry) {
+				/* move reps[rep] to the front */
+				dist = lzma->reps[rep];
+				for (; rep; --rep)
+					lzma->reps[rep] = lzma->reps[rep - 1];
+				lzma->reps[0] = dist;
+			}
+		}
+		len = length(rc, &lzma->repLenDecoder, pos_state, dry);
+		if (dry)
+			return 0;
+		update_long_rep(lzma->state);
+	}
+
+	if (!dict_is_distance_valid(lzma, lzma->reps[0]))
+		return -EBADMSG;
+	lzma->remain_len = len;
+	dict_repeat(lzma, limit);
+	return 0;
+}
+
+/*
+ * Decode into the window until dict.pos reaches @limit. At least
+ * LZMA_REQUIRED_INPUT_MAX bytes is enough for any symbol, so the hot loop
+ * runs without any input check until the last few bytes, which are then
+ * handled one symbol at a time in lzma->temp after a dry run.
+ */
+static int lzma_decode(struct lzma_decoder *lzma,
+		       const uint8_t **in, const uint8_t *iend,
+		       const uint32_t limit)
+{
+	struct lzma_rc_decoder rc = lzma->rc;
+	int err = 0;
+
+	while (lzma->dict.pos < limit && !lzma->eos) {
+		unsigned int oldsize, n, used;
+
+		if (lzma->remain_len) {
+			dict_repeat(lzma, limit);
+			continue;
+		}
+
+		if (!lzma->tempsize && iend - *in >= LZMA_REQUIRED_INPUT_MAX) {
+			rc.ip = *in;
+			do {
+				err = lzma_decode_symbol(lzma, &rc, limit, false);
+			} while (!err && lzma->dict.pos < limit && !lzma->eos &&
+				 iend - rc.ip >= LZMA_REQUIRED_INPUT_MAX);
+			*in = rc.ip;
+			if (err)
+				break;
+			continue;
+		}
+
+		/* the safe path, fill lzma->temp and try the next symbol */
+		oldsize = lzma->tempsize;
+		n = min_t(unsigned int, LZMA_REQUIRED_INPUT_MAX - oldsize,
+			  iend - *in);
+		memcpy(lzma->temp + oldsize, *in, n);
+		rc.ip = lzma->temp;
+		rc.iend = lzma->temp + oldsize + n;
+
+		if (oldsize + n < LZMA_REQUIRED_INPUT_MAX) {
+			struct lzma_rc_decoder dummy = rc;
+
+			lzma_decode_symbol(lzma, &dummy, limit, true);
+			if (dummy.ip > dummy.iend) {
+				/* keep all input in temp, and ask for more */
+				lzma->tempsize = oldsize + n;
+				*in += n;
+				err = -ERANGE;
+				break;
+			}
+		}
+
+		err = lzma_decode_symbol(lzma, &rc, limit, false);
+		used = rc.ip - lzma->temp;
+		if (used >= oldsize) {
+			*in += used - oldsize;
+			lzma->tempsize = 0;
+		} else {
+			memmove(lzma->temp, lzma->temp + used, oldsize - used);
+			lzma->tempsize = oldsize - used;
+		}
+		if (err)
+			break;
+	}
+	lzma->rc.range = rc.range;
+	lzma->rc.code = rc.code;
+	return err;
+}
+
+static void lzma_length_decoder_reset(struct lzma_length_decoder *ld)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(ld->low); i++)
+		ld->low[i] = kProbInitValue;
+
+	for (i = 0; i < ARRAY_SIZE(ld->high); i++)
+		ld->high[i] = kProbInitValue;
+}
+
+static int lzma_decoder_alloc_window(struct lzma_decoder *lzma,
+				     uint32_t size)
+{
+	size = max_t(uint32_t, size, LZMA_DICT_MIN);
+	if (lzma->dict.buf && lzma->dict.size != size) {
+		free(lzma->dict.buf);
+		lzma->dict.buf = NULL;
+	}
+
+	if (!lzma->dict.buf) {
+		lzma->dict.buf = malloc(size);
+		if (!lzma->dict.buf)
+			return -ENOMEM;
+		lzma->dict.size = size;
+	}
+	lzma->dict.pos = lzma->dict.full = 0;
+	/* the previous byte of the first literal is 0 */
+	lzma->dict.buf[size - 1] = 0;
+	return 0;
+}
+
+static int lzma_decoder_reset(struct lzma_decoder *lzma,
+			      unsigned int lc, unsigned int lp,
+			      unsigned int pb, uint32_t dictsize,
+			      uint64_t uncompressed)
+{
+	unsigned int i, j;
+	int err;
+
+	if (lc > 8 || lp > 4 || pb > LZMA_PB_MAX)
+		return -EINVAL;
+
+	/* no need to keep a window larger than the whole output */
+	lzma->dictsize = dictsize;
+	err = lzma_decoder_alloc_window(lzma,
+				min_t(uint64_t, dictsize, uncompressed));
+	if (err)
+		return err;
+	lzma->uncompressed = uncompressed;
+
+	lzma->rc_inited = false;
+	lzma->tempsize = 0;
+	lzma->position = 0;
+	lzma->remain_len = 0;
+	lzma->eos = false;
+
+	lzma->state = 0;
+	lzma->reps[0] = lzma->reps[1] = lzma->reps[2] =
+		lzma->reps[3] = 1;
+
+	for (i = 0; i < kNumStates; ++i) {
+		for (j = 0; j < LZMA_NUM_PB_STATES_MAX; ++j) {
+			lzma->isMatch[i][j] = kProbInitValue;
+			lzma->isRep0Long[i][j] = kProbInitValue;
+		}
+		lzma->isRep[i] = kProbInitValue;
+		lzma->isRepG0[i] = kProbInitValue;
+		lzma->isRepG1[i] = kProbInitValue;
+		lzma->isRepG2[i] = kProbInitValue;
+	}
+
+	for (i = 0; i < kNumLenToPosStates; ++i)
+		for (j = 0; j < (1 << kNumPosSlotBits); j++)
+			lzma->posSlotDecoder[i][j] = kProbInitValue;
+
+	for (i = 0; i < ARRAY_SIZE(lzma->posDecoders); i++)
+		lzma->posDecoders[i] = kProbInitValue;
+
+	for (i = 0; i < ARRAY_SIZE(lzma->posAlignDecoder); i++)
+		lzma->posAlignDecoder[i] = kProbInitValue;
+
+	free(lzma->literal);
+	lzma->literal = malloc((0x300 << (lc + lp)) * sizeof(probability));
+	if (!lzma->literal)
+		return -ENOMEM;
+
+	for (i = 0; i < (0x300 << (lc + lp)); i++)
+		lzma->literal[i] = kProbInitValue;
+
+	lzma->lc = lc;
+	lzma->pbMask = (1 << pb) - 1;
+	lzma->lpMask = (0x100 << lp) - (0x100 >> lc);
+
+	lzma_length_decoder_reset(&lzma->lenDecoder);
+	lzma_length_decoder_reset(&lzma->repLenDecoder);
+	return 0;
+}
+
+int lzma_decoder_init(struct lzma_decoder **lzmap,
+		      const uint8_t header[LZMA_HEADER_SIZE])
+{
+	unsigned int d = header[0];
+	uint32_t dictsize = get_unaligned_le32(header + 1);
+	uint64_t uncompressed = 0;
+	struct lzma_decoder *lzma;
+	int i, err;
+
+	if (d >= 9 * 5 * 5)
+		return -EINVAL;
+
+	for (i = 7; i >= 0; --i)
+		uncompressed = (uncompressed << 8) | header[5 + i];
+
+	lzma = calloc(1, sizeof(*lzma));
+	if (!lzma)
+		return -ENOMEM;
+
+	err = lzma_decoder_reset(lzma, d % 9, d / 9 % 5, d / 45,
+				 dictsize, uncompressed);
+	if (err) {
+		lzma_decoder_end(lzma);
+		return err;
+	}
+	*lzmap = lzma;
+	return 0;
+}
+
+int lzma_decoder_update(struct lzma_decoder *lzma,
+			const uint8_t **in, const uint8_t *iend,
+			uint8_t **out, uint8_t *oend)
+{
+	uint8_t *op = *out;
+	int err;
+
+	if (!lzma->rc_inited) {
+		const unsigned int n =
+			min_t(unsigned int, RC_INIT_BYTES - lzma->tempsize,
+			      iend - *in);
+
+		memcpy(lzma->temp + lzma->tempsize, *in, n);
+		*in += n;
+		lzma->tempsize += n;
+		if (lzma->tempsize < RC_INIT_BYTES)
+			return -ERANGE;
+
+		err = rc_read_init(&lzma->rc, lzma->temp);
+		if (err)
+			return err;
+		lzma->tempsize = 0;
+		lzma->rc_inited = true;
+	}
+
+	while (1) {
+		uint32_t start, decoded;
+		uint64_t n;
+
+		if (lzma->eos || !lzma->uncompressed) {
+			err = 0;
+			break;
+		}
+
+		if (op >= oend) {
+			err = -ENOSPC;
+			break;
+		}
+
+		/* the window is full, wrap around */
+		if (lzma->dict.pos == lzma->dict.size) {
+			lzma->dict.full = lzma->dict.size;
+			lzma->dict.pos = 0;
+		}
+
+		start = lzma->dict.pos;
+		n = min_t(uint64_t, oend - op, lzma->dict.size - start);
+		n = min(n, lzma->uncompressed);
+
+		err = lzma_decode(lzma, in, iend, start + n);
+
+		decoded = lzma->dict.pos - start;
+		memcpy(op, lzma->dict.buf + start, decoded);
+		op += decoded;
+		if (lzma->uncompressed != UINT64_MAX)
+			lzma->uncompressed -= decoded;
+		lzma->dict.full = max(lzma->dict.full, lzma->dict.pos);
+		if (err)
+			break;
+	}
+	*out = op;
+	return err;
+}
+
+int lzma_decoder_preset_dict(struct lzma_decoder *lzma,
+			     const uint8_t *dict, uint32_t size)
+{
+	int err;
+
+	if (lzma->position)
+		return -EBUSY;
+
+	/* the same as lzma_encoder_preset_dict(), keep the last dictsize */
+	if (size > lzma->dictsize) {
+		dict += size - lzma->dictsize;
+		size = lzma->dictsize;
+	}
+
+	if (!size)
+		return 0;
+
+	if (lzma->dict.size < lzma->dictsize) {
+		err = lzma_decoder_alloc_window(lzma, min_t(uint64_t,
+				lzma->dictsize, size + min_t(uint64_t,
+					lzma->uncompressed, lzma->dictsize)));
+		if (err)
+			return err;
+	}
+
+	memcpy(lzma->dict.buf, dict, size);
+	lzma->dict.pos = lzma->dict.full = size;
+	/* positions go on from the dictionary, as what the encoder does */
+	lzma->position = size;
+	return 0;
+}
+
+void lzma_decoder_end(struct lzma_decoder *lzma)
+{
+	free(lzma->dict.buf);
+	free(lzma->literal);
+	free(lzma);
+}
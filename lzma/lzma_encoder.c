@@ -5,40 +5,18 @@
  * Copyright (C) 2019 Gao Xiang <hsiangkao@aol.com>
  */
 #include <stdlib.h>
+#include <stddef.h>
 #include <ez/bitops.h>
 #include "lzma_common.h"
+#include "lzma_encoder.h"
 #include "mf.h"
 #include "rc_encoder_ckpt.h"
-#include <stdio.h>
+#include "rc_price.h"
 
-#define kNumBitModelTotalBits	11
-#define kBitModelTotal		(1 << kNumBitModelTotalBits)
-#define kProbInitValue		(kBitModelTotal >> 1)
-
-#define kNumStates		12
-#define LZMA_PB_MAX		4
-#define LZMA_NUM_PB_STATES_MAX	(1 << LZMA_PB_MAX)
-
-#define kLenNumLowBits		3
-#define kLenNumLowSymbols	(1 << kLenNumLowBits)
-#define kLenNumHighBits		8
-#define kLenNumHighSymbols	(1 << kLenNumHighBits)
-
-#define kNumLenToPosStates	4
-#define kNumPosSlotBits		6
-
-#define kStartPosModelIndex	4
-#define kEndPosModelIndex	14
-#define kNumFullDistances	(1 << (kEndPosModelIndex >> 1))
-
-#define kNumAlignBits		4
-#define kAlignTableSize		(1 << kNumAlignBits)
-#define kAlignMask		(kAlignTableSize - 1)
-
-#define kNumLenToPosStates	4
-#define kMatchMinLen		MATCH_LEN_MIN
-
-#define is_literal_state(state) ((state) < 7)
+/* the maximum number of positions looked ahead by the optimal parser */
+#define LZMA_OPTS		(1 << 12)
+/* and by the fast parser for a better match (the lazy one looks less) */
+#define LZMA_FAST_AHEAD_MAX	32
 
 /* note that here dist is an zero-based distance */
 static unsigned int get_pos_slot2(unsigned int dist)
@@ -53,36 +31,48 @@ static unsigned int get_pos_slot(unsigned int dist)
 	return dist <= 4 ? dist : get_pos_slot2(dist);
 }
 
-/* aka. GetLenToPosState in LZMA */
-static inline unsigned int get_len_state(unsigned int len)
-{
-	if (len < kNumLenToPosStates - 1 + kMatchMinLen)
-		return len - kMatchMinLen;
+struct lzma_length_encoder {
+	probability low[LZMA_NUM_PB_STATES_MAX << (kLenNumLowBits + 1)];
+	probability high[kLenNumHighSymbols];
+};
 
-	return kNumLenToPosStates - 1;
-}
+/* length prices for each pos_state, refreshed after table_size symbols */
+struct lzma_length_prices {
+	uint32_t table_size;
+	uint32_t counters[LZMA_NUM_PB_STATES_MAX];
+	uint32_t prices[LZMA_NUM_PB_STATES_MAX][LEN_SYMBOLS];
+};
 
-struct lzma_properties {
-	uint32_t lc;	/* 0 <= lc <= 8, default = 3 */
-	uint32_t lp;	/* 0 <= lp <= 4, default = 0 */
-	uint32_t pb;	/* 0 <= pb <= 4, default = 2 */
+/* a position of the optimal parsing array, see lzma_get_optimum_normal() */
+struct lzma_optimal {
+	enum lzma_lzma_state state;
 
-	struct lzma_mf_properties mf;
-};
+	/* the path to this position ends with a literal (+ a rep0 match) */
+	bool prev_1_is_literal;
+	bool prev_2;
 
-struct lzma_length_encoder {
-	probability low[LZMA_NUM_PB_STATES_MAX << (kLenNumLowBits + 1)];
-	probability high[kLenNumHighSymbols];
+	uint32_t pos_prev_2;
+	uint32_t back_prev_2;
+
+	uint32_t price;
+	uint32_t pos_prev;
+	uint32_t back_prev;
+
+	/* the four most recent match distances at this position */
+	uint32_t backs[LZMA_NUM_REPS];
 };
 
+/* the number of cheaper symbols tried once the output is almost full */
+#define LZMA_DESTSIZE_RETRIES	8
+
 struct lzma_encoder_destsize {
 	struct lzma_rc_ckpt cp;
-
-	uint8_t *op;
 	uint32_t capacity;
 
-	uint32_t esz;
-	uint8_t ending[LZMA_REQUIRED_INPUT_MAX + 5];
+	/* the symbol queued last and the encoder state before it */
+	uint32_t back, len;
+	enum lzma_lzma_state state;
+	uint32_t reps[LZMA_NUM_REPS];
 };
 
 struct lzma_encoder {
@@ -92,9 +82,19 @@ struct lzma_encoder {
 	uint8_t *op, *oend;
 	bool finish;
 	bool need_eopm;
+	/* the end marker and rc flush have been queued */
+	bool ended;
+
+	enum lzma_mode mode;
 
 	enum lzma_lzma_state state;
 
+	/* the sequence being encoded, which is kept if output is full */
+	struct {
+		unsigned int nlits;
+		uint32_t back, len;
+	} seq;
+
 	/* the four most recent match distances */
 	uint32_t reps[LZMA_NUM_REPS];
 
@@ -114,26 +114,154 @@ struct lzma_encoder {
 	probability posEncoders[kNumFullDistances];
 	probability posAlignEncoder[1 << kNumAlignBits];
 
-	probability *literal;
-
 	struct lzma_length_encoder lenEnc;
 	struct lzma_length_encoder repLenEnc;
 
+	probability *literal;
+	size_t literalcap;
+
+	/*
+	 * cached prices for the optimal parser, which are refreshed after
+	 * a number of symbols have been coded rather than for each query.
+	 */
+	struct lzma_length_prices lenPrices, repLenPrices;
+	uint32_t posSlotPrices[kNumLenToPosStates][1 << kNumPosSlotBits];
+	uint32_t distPrices[kNumLenToPosStates][kNumFullDistances];
+	uint32_t alignPrices[kAlignTableSize];
+	unsigned int distTableSize;
+	unsigned int matchPriceCount, alignPriceCount;
+
 	struct {
 		struct lzma_match matches[MATCH_LEN_MAX];
 		unsigned int matches_count;
 	} fast;
 
+	struct {
+		struct lzma_match matches[MATCH_LEN_MAX];
+		unsigned int matches_count;
+
+		/* the decided but not yet encoded symbols in opts[] */
+		unsigned int cur_index, end_index;
+		struct lzma_optimal opts[LZMA_OPTS];
+	} optimum;
+
 	struct lzma_encoder_destsize *dstsize;
+
+	/* the LZMA2 chunk being encoded, climit == 0 if not chunked */
+	struct {
+		uint8_t *out;
+		uint32_t climit, ulimit;
+		uint32_t usize;
+	} chunk;
+
+	/* the properties of the current stream */
+	struct lzma_properties props;
+
+#ifdef LZMA_STATS
+	struct lzma_stats stats;
+#endif
+};
+
+/* all fixed-size probabilities, which are laid out from isMatch to repLenEnc */
+#define LZMA_PROBS_OFFSET	offsetof(struct lzma_encoder, isMatch)
+#define LZMA_PROBS_SIZE		(offsetof(struct lzma_encoder, repLenEnc) + \
+				 sizeof(struct lzma_length_encoder) - \
+				 LZMA_PROBS_OFFSET)
+
+/* the snapshot of them for a new stream, restored with a single memcpy */
+static const probability lzma_probs_init[LZMA_PROBS_SIZE /
+					 sizeof(probability)] = {
+	[0 ... LZMA_PROBS_SIZE / sizeof(probability) - 1] = kProbInitValue,
 };
 
 #define change_pair(smalldist, bigdist) (((bigdist) >> 7) > (smalldist))
 
+/*
+ * rough sizes in bits for the lazy evaluation rather than prices, which
+ * are only calculated for the normal mode: a literal is taken as 6 bits,
+ * a match as 10 bits plus the distance and a rep as 6 bits plus its index.
+ * Looking ahead also needs to save LAZY_DEFER_BITS more, since the literal
+ * left behind tends to cost more than that.
+ */
+#define LAZY_LIT_BITS	6
+#define LAZY_DEFER_BITS	4
+#define lazy_match_gain(len, dist)	\
+	((int)((len) * LAZY_LIT_BITS) - 10 - fls(dist))
+#define lazy_rep_gain(len, rep)		\
+	((int)((len) * LAZY_LIT_BITS) - 6 - (int)(rep))
+
+/* look ahead at ip + 1 for a match or rep which saves more than the current */
+static bool lzma_lazy_better(struct lzma_encoder *lzma, const uint8_t *ip,
+			     const struct lzma_match *victim,
+			     unsigned int *len_res, unsigned int *back_res,
+			     unsigned int *replen_res, unsigned int *rep_res)
+{
+	const uint8_t *const ip1 = ip + 1;
+	const uint8_t *const iend = lzma->mf.iend;
+	const uint8_t *const ilimit = (iend <= ip1 + MATCH_LEN_MAX ?
+				       iend : ip1 + MATCH_LEN_MAX);
+	bool better = false;
+	int gain;
+	unsigned int i;
+
+	if (*replen_res)
+		gain = lazy_rep_gain(*len_res, *rep_res);
+	else
+		gain = lazy_match_gain(*len_res, *back_res);
+	gain += LAZY_DEFER_BITS;
+
+	if (victim && lazy_match_gain(victim->len, victim->dist) > gain) {
+		gain = lazy_match_gain(victim->len, victim->dist);
+		*len_res = victim->len;
+		*back_res = victim->dist;
+		*replen_res = 0;
+		better = true;
+	}
+
+	if (ilimit - ip1 < MATCH_LEN_MIN)
+		return better;
+
+	/* also replaces the match above if it's of a rep distance */
+	for (i = 0; i < LZMA_NUM_REPS; ++i) {
+		const uint8_t *const repp = ip1 - lzma->reps[i];
+		uint32_t len;
+
+		if (get_unaligned16(ip1) != get_unaligned16(repp))
+			continue;
+
+		len = ez_memcmp(ip1 + 2, repp + 2, ilimit) - ip1;
+		if (lazy_rep_gain(len, i) > gain) {
+			gain = lazy_rep_gain(len, i);
+			*len_res = *replen_res = len;
+			*rep_res = i;
+			better = true;
+		}
+	}
+	return better;
+}
+
+/*
+ * Unless it's the end of input, parse a position only if all bytes which can
+ * be looked at from it are in the window: matches found up to @span positions
+ * ahead and skipped past at most MATCH_LEN_MAX bytes, each of which looks at
+ * MATCH_LEN_MAX bytes more. Otherwise the parse would depend on how input is
+ * given, so it's done again once more input comes.
+ */
+static bool lzma_need_input(const struct lzma_encoder *lzma, uint32_t span)
+{
+	const struct lzma_mf *mf = &lzma->mf;
+
+	return !lzma->finish &&
+		mf->iend - (mf->buffer + mf->cur - mf->lookahead) <
+		span + 2 * MATCH_LEN_MAX;
+}
+
 static int lzma_get_optimum_fast(struct lzma_encoder *lzma,
 				 uint32_t *back_res, uint32_t *len_res)
 {
 	struct lzma_mf *const mf = &lzma->mf;
 	const uint32_t nice_len = mf->nice_len;
+	const uint32_t lazy = lzma->props.lazy;
 
 	struct lzma_match matches[MATCH_LEN_MAX + 1];
 	unsigned int matches_count, i;
@@ -143,6 +271,9 @@ static int lzma_get_optimum_fast(struct lzma_encoder *lzma,
 	uint32_t len;
 	int ret;
 
+	if (lzma_need_input(lzma, LZMA_FAST_AHEAD_MAX))
+		return -ERANGE;
+
 	if (!mf->lookahead) {
 		ret = lzma_mf_find(mf, lzma->fast.matches, lzma->finish);
 
@@ -165,7 +296,7 @@ static int lzma_get_optimum_fast(struct lzma_encoder *lzma,
 	ilimit = (mf->iend <= ip + MATCH_LEN_MAX ?
 		  mf->iend : ip + MATCH_LEN_MAX);
 
-	best_replen = 0;
+	best_replen = best_rep = 0;
 
 	/* look for all valid repeat matches */
 	for (i = 0; i < LZMA_NUM_REPS; ++i) {
@@ -236,6 +367,13 @@ static int lzma_get_optimum_fast(struct lzma_encoder *lzma,
 	while (1) {
 		const struct lzma_match *victim;
 
+		/* the lazy evaluation looks up to props.lazy positions ahead */
+		if (lazy && ip - ista >= lazy)
+			break;
+		/* and the others as far as lzma_need_input() has checked */
+		if (ip - ista >= LZMA_FAST_AHEAD_MAX)
+			break;
+
 		ret = lzma_mf_find(mf, lzma->fast.matches, lzma->finish);
 
 		if (ret < 0) {
@@ -244,6 +382,19 @@ static int lzma_get_optimum_fast(struct lzma_encoder *lzma,
 		}
 
 		lzma->fast.matches_count = ret;
+		if (lazy) {
+			victim = (ret ? &lzma->fast.matches[ret - 1] : NULL);
+			if (!lzma_lazy_better(lzma, ip, victim,
+					      &longest_match_length,
+					      &longest_match_back,
+					      &best_replen, &best_rep))
+				break;
+			++ip;
+			if (longest_match_length >= nice_len)
+				break;
+			continue;
+		}
+
 		if (!ret)
 			break;
 
@@ -308,7 +459,8 @@ static int lzma_get_optimum_fast(struct lzma_encoder *lzma,
 		*back_res = LZMA_NUM_REPS + longest_match_back - 1;
 
 	*len_res = longest_match_length;
-	lzma_mf_skip(mf, longest_match_length - 2 + (ret < 0));
+	/* the match finder may not have gone past ip + 1 yet */
+	lzma_mf_skip(mf, ip + longest_match_length - (mf->buffer + mf->cur));
 	return ip - ista;
 
 out_literal:
@@ -316,39 +468,27 @@ out_literal:
 	return 1;
 }
 
-static void literal_matched(struct lzma_rc_encoder *rc, probability *probs,
-			    uint32_t match_byte, uint32_t symbol)
+static probability *literal_probs(struct lzma_encoder *lzma,
+				  uint32_t position, uint8_t prev_byte)
 {
-	uint32_t offset = 0x100;
-
-	symbol += 0x100;
-	do {
-		const unsigned int bit = (symbol >> 7) & 1;
-		const unsigned int match_bit = (match_byte <<= 1) & offset;
-
-		rc_bit(rc, &probs[offset + match_bit + (symbol >> 8)], bit);
-		symbol <<= 1;
-		offset &= ~(match_byte ^symbol);
-	} while (symbol < 0x10000);
+	return lzma->literal +
+		3 * ((((position << 8) + prev_byte) & lzma->lpMask) << lzma->lc);
 }
 
 static int literal(struct lzma_encoder *lzma, uint32_t position)
 {
-	static const unsigned char kLiteralNextStates[] =
-		{0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 4, 5};
 	struct lzma_mf *mf = &lzma->mf;
 	const uint8_t *ptr = &mf->buffer[mf->cur - mf->lookahead];
 	const unsigned int state = lzma->state;
 
-	probability *probs = lzma->literal +
-		3 * ((((position << 8) + ptr[-1]) & lzma->lpMask) << lzma->lc);
+	probability *probs = literal_probs(lzma, position, ptr[-1]);
 
 	if (is_literal_state(state)) {
 		/*
 		 * Previous LZMA-symbol was a literal. Encode a normal
 		 * literal without a match byte.
 		 */
-		rc_bittree(&lzma->rc, probs, 8, *ptr);
+		rc_literal(&lzma->rc, probs, *ptr);
 	} else {
 		/*
 		 * Previous LZMA-symbol was a match. Use the byte + 1
@@ -357,7 +497,7 @@ static int literal(struct lzma_encoder *lzma, uint32_t position)
 		 */
 		const uint8_t match_byte = *(ptr - lzma->reps[0]);
 
-		literal_matched(&lzma->rc, probs, match_byte, *ptr);
+		rc_literal_matched(&lzma->rc, probs, match_byte, *ptr);
 	}
 
 	lzma->state = kLiteralNextStates[state];
@@ -387,6 +527,45 @@ static void length(struct lzma_rc_encoder *rc,
 		   kLenNumLowBits, sym);
 }
 
+static void length_update_prices(struct lzma_length_prices *lp,
+				 const struct lzma_length_encoder *lc,
+				 const uint32_t pos_state)
+{
+	const probability *const low = lc->low;
+	const probability *const mid = low + kLenNumLowSymbols;
+	const uint32_t a0 = rc_bit_0_price(low[0]);
+	const uint32_t a1 = rc_bit_1_price(low[0]);
+	const uint32_t b0 = a1 + rc_bit_0_price(mid[0]);
+	const uint32_t b1 = a1 + rc_bit_1_price(mid[0]);
+	uint32_t *const prices = lp->prices[pos_state];
+	const uint32_t table_size = lp->table_size;
+	uint32_t i;
+
+	for (i = 0; i < table_size && i < kLenNumLowSymbols; ++i)
+		prices[i] = a0 + rc_bittree_price(low +
+				(pos_state << (kLenNumLowBits + 1)),
+				kLenNumLowBits, i);
+
+	for (; i < table_size && i < kLenNumLowSymbols * 2; ++i)
+		prices[i] = b0 + rc_bittree_price(mid +
+				(pos_state << (kLenNumLowBits + 1)),
+				kLenNumLowBits, i - kLenNumLowSymbols);
+
+	for (; i < table_size; ++i)
+		prices[i] = b1 + rc_bittree_price(lc->high, kLenNumHighBits,
+						  i - kLenNumLowSymbols * 2);
+	lp->counters[pos_state] = table_size;
+}
+
+/* refresh the length prices of pos_state after table_size lengths coded */
+static inline void length_count_prices(struct lzma_length_prices *lp,
+				       const struct lzma_length_encoder *lc,
+				       const uint32_t pos_state)
+{
+	if (!--lp->counters[pos_state])
+		length_update_prices(lp, lc, pos_state);
+}
+
 /* Match */
 static void match(struct lzma_encoder *lzma, const uint32_t pos_state,
 		  const uint32_t dist, const uint32_t len)
@@ -396,6 +575,8 @@ static void match(struct lzma_encoder *lzma, const uint32_t pos_state,
 
 	lzma->state = (is_literal_state(lzma->state) ? 7 : 10);
 	length(&lzma->rc, &lzma->lenEnc, pos_state, len);
+	if (lzma->mode == LZMA_MODE_NORMAL)
+		length_count_prices(&lzma->lenPrices, &lzma->lenEnc, pos_state);
 
 	/* - unsigned posSlot = PosSlotDecoder[lenState].Decode(&RangeDec); */
 	rc_bittree(&lzma->rc, lzma->posSlotEncoder[lenState],
@@ -421,8 +602,10 @@ static void match(struct lzma_encoder *lzma, const uint32_t pos_state,
 			rc_bittree_reverse(&lzma->rc, lzma->posAlignEncoder,
 					   kNumAlignBits,
 					   dist_reduced & kAlignMask);
+			++lzma->alignPriceCount;
 		}
 	}
+	++lzma->matchPriceCount;
 	lzma->reps[3] = lzma->reps[2];
 	lzma->reps[2] = lzma->reps[1];
 	lzma->reps[1] = lzma->reps[0];
@@ -460,282 +643,1210 @@ static void rep_match(struct lzma_encoder *lzma, const uint32_t pos_state,
 		lzma->state = is_literal_state(state) ? 9 : 11;
 	} else {
 		length(&lzma->rc, &lzma->repLenEnc, pos_state, len);
+		if (lzma->mode == LZMA_MODE_NORMAL)
+			length_count_prices(&lzma->repLenPrices,
+					    &lzma->repLenEnc, pos_state);
 		lzma->state = is_literal_state(state) ? 8 : 11;
 	}
 }
 
-struct lzma_endstate {
-	struct lzma_length_encoder lenEnc;
-
-	probability simpleMatch[2];
-	probability posSlot[kNumPosSlotBits];
-	probability posAlign[kNumAlignBits];
-};
-
-static void encode_eopm_stateless(struct lzma_encoder *lzma,
-				  struct lzma_endstate *endstate)
+/*
+ * Prices of LZMA symbols calculated from the current probabilities,
+ * which are used by the optimal parser.
+ */
+static uint32_t literal_price(struct lzma_encoder *lzma, uint32_t position,
+			      uint8_t prev_byte, bool matched,
+			      uint32_t match_byte, uint32_t symbol)
 {
-	const uint32_t pos_state =
-		(lzma->mf.cur - lzma->mf.lookahead) & lzma->pbMask;
-	const unsigned int state = lzma->state;
-	unsigned int i;
-
-	endstate->simpleMatch[0] = lzma->isMatch[state][pos_state];
-	endstate->simpleMatch[1] = lzma->isRep[state];
-	endstate->lenEnc = lzma->lenEnc;
-
-	rc_bit(&lzma->rc, endstate->simpleMatch, 1);
-	rc_bit(&lzma->rc, endstate->simpleMatch + 1, 0);
-	length(&lzma->rc, &endstate->lenEnc, pos_state, kMatchMinLen);
+	const probability *probs = literal_probs(lzma, position, prev_byte);
+	uint32_t offset = 0x100, price = 0;
 
-	for (i = 0; i < kNumPosSlotBits; ++i) {
-		endstate->posSlot[i] =
-			lzma->posSlotEncoder[0][(1 << (i + 1)) - 1];
-		rc_bit(&lzma->rc, endstate->posSlot + i, 1);
-	}
+	if (!matched)
+		return rc_bittree_price(probs, 8, symbol);
 
-	rc_direct(&lzma->rc, (1 << (30 - kNumAlignBits)) - 1,
-		  30 - kNumAlignBits);
+	/* the same as rc_encode_literal() */
+	symbol += 0x100;
+	do {
+		const unsigned int bit = (symbol >> 7) & 1;
+		const unsigned int match_bit = (match_byte <<= 1) & offset;
 
-	for (i = 0; i < kNumAlignBits; ++i) {
-		endstate->posAlign[i] =
-			lzma->posAlignEncoder[(1 << (i + 1)) - 1];
-		rc_bit(&lzma->rc, endstate->posAlign + i, 1);
-	}
+		price += rc_bit_price(probs[offset + match_bit + (symbol >> 8)],
+				      bit);
+		symbol <<= 1;
+		offset &= ~(match_byte ^ symbol);
+	} while (symbol < 0x10000);
+	return price;
 }
 
-static void encode_eopm(struct lzma_encoder *lzma)
+static inline uint32_t length_price(const struct lzma_length_prices *lp,
+				   const uint32_t pos_state,
+				   const uint32_t len)
 {
-	const uint32_t pos_state =
-		(lzma->mf.cur - lzma->mf.lookahead) & lzma->pbMask;
-	const unsigned int state = lzma->state;
-
-	rc_bit(&lzma->rc, &lzma->isMatch[state][pos_state], 1);
-	rc_bit(&lzma->rc, &lzma->isRep[state], 0);
-	match(lzma, pos_state, UINT32_MAX, MATCH_LEN_MIN);
+	DBG_BUGON(len - kMatchMinLen >= lp->table_size);
+	return lp->prices[pos_state][len - kMatchMinLen];
 }
 
-static int __flush_symbol_destsize(struct lzma_encoder *lzma)
+static uint32_t short_rep_price(struct lzma_encoder *lzma,
+				const unsigned int state,
+				const uint32_t pos_state)
 {
-	uint8_t *op2;
-	unsigned symbols_size;
+	return rc_bit_0_price(lzma->isRepG0[state]) +
+		rc_bit_0_price(lzma->isRep0Long[state][pos_state]);
+}
 
-	if (lzma->dstsize->capacity < 5)
-		return -ENOSPC;
+static uint32_t pure_rep_price(struct lzma_encoder *lzma, const uint32_t rep,
+			       const unsigned int state,
+			       const uint32_t pos_state)
+{
+	uint32_t price;
 
-	if (!lzma->rc.pos) {
-		rc_write_checkpoint(&lzma->rc, &lzma->dstsize->cp);
-		lzma->dstsize->op = lzma->op;
+	if (!rep) {
+		price = rc_bit_0_price(lzma->isRepG0[state]);
+		price += rc_bit_1_price(lzma->isRep0Long[state][pos_state]);
+	} else {
+		price = rc_bit_1_price(lzma->isRepG0[state]);
+		if (rep == 1) {
+			price += rc_bit_0_price(lzma->isRepG1[state]);
+		} else {
+			price += rc_bit_1_price(lzma->isRepG1[state]);
+			price += rc_bit_price(lzma->isRepG2[state], rep - 2);
+		}
 	}
+	return price;
+}
 
-	if (rc_encode(&lzma->rc, &lzma->op, lzma->oend))
-		return -ENOSPC;
+static uint32_t rep_price(struct lzma_encoder *lzma, const uint32_t rep,
+			  const uint32_t len, const unsigned int state,
+			  const uint32_t pos_state)
+{
+	return length_price(&lzma->repLenPrices, pos_state, len) +
+		pure_rep_price(lzma, rep, state, pos_state);
+}
 
-	op2 = lzma->op;
-	symbols_size = op2 - lzma->dstsize->op;
-	if (lzma->dstsize->capacity < symbols_size + 5)
-		goto err_enospc;
+/* note that here dist is an zero-based distance */
+static uint32_t dist_len_price(struct lzma_encoder *lzma, const uint32_t dist,
+			       const uint32_t len, const uint32_t pos_state)
+{
+	const uint32_t lenState = get_len_state(len);
+	uint32_t price;
 
-	if (!lzma->need_eopm)
-		goto out;
+	if (dist < kNumFullDistances)
+		price = lzma->distPrices[lenState][dist];
+	else
+		price = lzma->posSlotPrices[lenState][get_pos_slot2(dist)] +
+			lzma->alignPrices[dist & kAlignMask];
 
-	if (lzma->dstsize->capacity < symbols_size +
-	    LZMA_REQUIRED_INPUT_MAX + 5) {
-		struct lzma_rc_ckpt cp2;
-		struct lzma_endstate endstate;
-		uint8_t ending[sizeof(lzma->dstsize->ending)];
-		uint8_t *ep;
-		unsigned int esz;
+	return price + length_price(&lzma->lenPrices, pos_state, len);
+}
 
-		rc_write_checkpoint(&lzma->rc, &cp2);
-		encode_eopm_stateless(lzma, &endstate);
-		rc_flush(&lzma->rc);
+static void fill_dist_prices(struct lzma_encoder *lzma)
+{
+	uint32_t lenState, posSlot, dist;
 
-		ep = ending;
-		if (rc_encode(&lzma->rc, &ep, ending + sizeof(ending)))
-			DBG_BUGON(1);
+	for (lenState = 0; lenState < kNumLenToPosStates; ++lenState) {
+		uint32_t *const prices = lzma->posSlotPrices[lenState];
 
-		esz = ep - ending;
+		for (posSlot = 0; posSlot < lzma->distTableSize; ++posSlot)
+			prices[posSlot] = rc_bittree_price(
+				lzma->posSlotEncoder[lenState],
+				kNumPosSlotBits, posSlot);
 
-		if (lzma->dstsize->capacity < symbols_size + esz)
-			goto err_enospc;
-		rc_restore_checkpoint(&lzma->rc, &cp2);
+		/* the direct bits of slots >= kEndPosModelIndex */
+		for (posSlot = kEndPosModelIndex;
+		     posSlot < lzma->distTableSize; ++posSlot)
+			prices[posSlot] += rc_direct_price((posSlot >> 1) - 1 -
+							   kNumAlignBits);
 
-		memcpy(lzma->dstsize->ending, ending, sizeof(ending));
-		lzma->dstsize->esz = esz;
+		for (dist = 0; dist < kStartPosModelIndex; ++dist)
+			lzma->distPrices[lenState][dist] = prices[dist];
 	}
-out:
-	lzma->dstsize->capacity -= symbols_size;
-	return 0;
 
-err_enospc:
-	rc_restore_checkpoint(&lzma->rc, &lzma->dstsize->cp);
-	lzma->op = lzma->dstsize->op;
-	lzma->dstsize->capacity = 0;
-	return -ENOSPC;
-}
-
-static int flush_symbol(struct lzma_encoder *lzma)
-{
-	if (lzma->rc.count && lzma->dstsize) {
-		const unsigned int safemargin =
-			5 + (LZMA_REQUIRED_INPUT_MAX << !!lzma->need_eopm);
-		uint8_t *op;
-		bool ret;
-
-		if (lzma->dstsize->capacity < safemargin)
-			return __flush_symbol_destsize(lzma);
-
-		op = lzma->op;
-		ret = rc_encode(&lzma->rc, &lzma->op, lzma->oend);
+	for (dist = kStartPosModelIndex; dist < kNumFullDistances; ++dist) {
+		const uint32_t posSlot = get_pos_slot(dist);
+		const uint32_t footer_bits = (posSlot >> 1) - 1;
+		const uint32_t base = (2 | (posSlot & 1)) << footer_bits;
+		const uint32_t price =
+			rc_bittree_reverse_price(lzma->posEncoders + base,
+						 footer_bits, dist);
 
-		lzma->dstsize->capacity -= lzma->op - op;
-		return ret ? -ENOSPC : 0;
+		for (lenState = 0; lenState < kNumLenToPosStates; ++lenState)
+			lzma->distPrices[lenState][dist] = price +
+				lzma->posSlotPrices[lenState][posSlot];
 	}
-
-	return rc_encode(&lzma->rc, &lzma->op, lzma->oend) ? -ENOSPC : 0;
+	lzma->matchPriceCount = 0;
 }
 
-static int encode_symbol(struct lzma_encoder *lzma, uint32_t back,
-			 uint32_t len, uint32_t *position)
+static void fill_align_prices(struct lzma_encoder *lzma)
 {
-	int err = flush_symbol(lzma);
-
-	if (!err) {
-		const uint32_t pos_state = *position & lzma->pbMask;
-		const unsigned int state = lzma->state;
-		struct lzma_mf *const mf = &lzma->mf;
-
-		if (back == MARK_LIT) {
-			/* literal i.e. 8-bit byte */
-			rc_bit(&lzma->rc, &lzma->isMatch[state][pos_state], 0);
-			literal(lzma, *position);
-			len = 1;
-		} else {
-			rc_bit(&lzma->rc, &lzma->isMatch[state][pos_state], 1);
-
-			if (back < LZMA_NUM_REPS) {
-				/* repeated match */
-				rc_bit(&lzma->rc, &lzma->isRep[state], 1);
-				rep_match(lzma, pos_state, back, len);
-			} else {
-				/* normal match */
-				rc_bit(&lzma->rc, &lzma->isRep[state], 0);
-				match(lzma, pos_state,
-				      back - LZMA_NUM_REPS, len);
-			}
-		}
+	unsigned int i;
 
-		/* len bytes has been consumed by encoder */
-		DBG_BUGON(mf->lookahead < len);
-		mf->lookahead -= len;
-		*position += len;
-	}
-	return err;
+	for (i = 0; i < kAlignTableSize; ++i)
+		lzma->alignPrices[i] =
+			rc_bittree_reverse_price(lzma->posAlignEncoder,
+						 kNumAlignBits, i);
+	lzma->alignPriceCount = 0;
 }
 
-/* encode sequence (literal, match) */
-static int encode_sequence(struct lzma_encoder *lzma, unsigned int nliterals,
-			   uint32_t back, uint32_t len, uint32_t *position)
+static inline void make_literal(struct lzma_optimal *opt)
 {
-	while (nliterals) {
-		int err = encode_symbol(lzma, MARK_LIT, 0, position);
+	opt->back_prev = MARK_LIT;
+	opt->prev_1_is_literal = false;
+}
 
-		if (err)
-			return err;
-		--nliterals;
-	}
-	if (!len)	/* no match */
-		return 0;
-	return encode_symbol(lzma, back, len, position);
+static inline void make_short_rep(struct lzma_optimal *opt)
+{
+	opt->back_prev = 0;
+	opt->prev_1_is_literal = false;
 }
 
-static int __lzma_encode(struct lzma_encoder *lzma)
+#define is_short_rep(opt)	((opt).back_prev == 0)
+
+/* walk back from opts[cur] to turn the cheapest path into a forward list */
+static void optimum_backward(struct lzma_encoder *lzma, uint32_t *back_res,
+			     uint32_t *len_res, uint32_t cur)
 {
-	uint32_t pos32 = lzma->mf.cur - lzma->mf.lookahead;
-	int err;
+	struct lzma_optimal *const opts = lzma->optimum.opts;
+	uint32_t pos_mem = opts[cur].pos_prev;
+	uint32_t back_mem = opts[cur].back_prev;
 
+	lzma->optimum.end_index = cur;
 	do {
-		uint32_t back, len;
-		int nlits;
+		uint32_t pos_prev, back_cur;
+
+		if (opts[cur].prev_1_is_literal) {
+			make_literal(&opts[pos_mem]);
+			opts[pos_mem].pos_prev = pos_mem - 1;
+
+			if (opts[cur].prev_2) {
+				opts[pos_mem - 1].prev_1_is_literal = false;
+				opts[pos_mem - 1].pos_prev =
+					opts[cur].pos_prev_2;
+				opts[pos_mem - 1].back_prev =
+					opts[cur].back_prev_2;
+			}
+		}
 
-		nlits = lzma_get_optimum_fast(lzma, &back, &len);
+		pos_prev = pos_mem;
+		back_cur = back_mem;
 
-		if (nlits < 0) {
-			err = nlits;
-			break;
-		}
+		back_mem = opts[pos_prev].back_prev;
+		pos_mem = opts[pos_prev].pos_prev;
 
-		printf("pos %u (%c) nlits %d (%d %d)\n", pos32,
-		       *(lzma->mf.buffer + pos32), nlits, back, len);
+		opts[pos_prev].back_prev = back_cur;
+		opts[pos_prev].pos_prev = cur;
+		cur = pos_prev;
+	} while (cur);
 
-		err = encode_sequence(lzma, nlits, back, len, &pos32);
-	} while (!err);
-	return err;
+	lzma->optimum.cur_index = opts[0].pos_prev;
+	*len_res = opts[0].pos_prev;
+	*back_res = opts[0].back_prev;
 }
 
-static int lzma_length_encoder_reset(struct lzma_length_encoder *lc)
+/*
+ * Fill in opts[] with all choices at the current position. Return the
+ * number of positions to look ahead, or 0 if the choice is obvious and
+ * *back_res, *len_res have been decided already.
+ */
+static int optimum_first_position(struct lzma_encoder *lzma,
+				  const uint32_t position,
+				  uint32_t *back_res, uint32_t *len_res)
 {
-	unsigned int i;
+	struct lzma_mf *const mf = &lzma->mf;
+	struct lzma_optimal *const opts = lzma->optimum.opts;
+	const struct lzma_match *const matches = lzma->optimum.matches;
+	const uint32_t nice_len = mf->nice_len;
+	const unsigned int state = lzma->state;
+	const uint32_t pos_state = position & lzma->pbMask;
+	uint32_t rep_lens[LZMA_NUM_REPS], rep_max_index = 0;
+	uint32_t matches_count, len_main, len_end, len, avail, i;
+	uint32_t match_price, rep_match_price, normal_match_price;
+	uint8_t current_byte, match_byte;
+	const uint8_t *ip;
 
-	for (i = 0; i < ARRAY_SIZE(lc->low); i++)
-		lc->low[i] = kProbInitValue;
+	if (!mf->lookahead) {
+		int ret = lzma_mf_find(mf, lzma->optimum.matches,
+				       lzma->finish);
 
-	for (i = 0; i < ARRAY_SIZE(lc->high); i++)
-		lc->high[i] = kProbInitValue;
+		if (ret < 0)
+			return ret;
+		lzma->optimum.matches_count = ret;
+	}
+
+	matches_count = lzma->optimum.matches_count;
+	len_main = matches_count ? matches[matches_count - 1].len : 0;
+
+	ip = mf->buffer + mf->cur - mf->lookahead;
+	avail = min_t(uint32_t, mf->iend - ip, MATCH_LEN_MAX);
+
+	/* the first byte has no history, and it's always a literal */
+	if (avail < 2 || !position) {
+		*back_res = MARK_LIT;
+		*len_res = 1;
+		return 0;
+	}
+
+	for (i = 0; i < LZMA_NUM_REPS; ++i) {
+		const uint8_t *const repp = ip - lzma->reps[i];
+
+		/* the first two bytes (MATCH_LEN_MIN == 2) do not match */
+		if (get_unaligned16(ip) != get_unaligned16(repp)) {
+			rep_lens[i] = 0;
+			continue;
+		}
+
+		rep_lens[i] = ez_memcmp(ip + 2, repp + 2, ip + avail) - ip;
+		if (rep_lens[i] > rep_lens[rep_max_index])
+			rep_max_index = i;
+	}
+
+	/* a repeated match at least nice_len, return it immediately */
+	if (rep_lens[rep_max_index] >= nice_len) {
+		*back_res = rep_max_index;
+		*len_res = rep_lens[rep_max_index];
+		lzma_mf_skip(mf, *len_res - 1);
+		return 0;
+	}
+
+	if (len_main >= nice_len) {
+		/* it's encoded as 0-based match distances */
+		*back_res = LZMA_NUM_REPS + matches[matches_count - 1].dist - 1;
+		*len_res = len_main;
+		lzma_mf_skip(mf, len_main - 1);
+		return 0;
+	}
+
+	current_byte = *ip;
+	match_byte = *(ip - lzma->reps[0]);
+
+	if (len_main < 2 && current_byte != match_byte &&
+	    rep_lens[rep_max_index] < 2) {
+		*back_res = MARK_LIT;
+		*len_res = 1;
+		return 0;
+	}
+
+	opts[0].state = state;
+
+	opts[1].price = rc_bit_0_price(lzma->isMatch[state][pos_state]) +
+		literal_price(lzma, position, ip[-1], !is_literal_state(state),
+			      match_byte, current_byte);
+	make_literal(&opts[1]);
+
+	match_price = rc_bit_1_price(lzma->isMatch[state][pos_state]);
+	rep_match_price = match_price + rc_bit_1_price(lzma->isRep[state]);
+
+	if (match_byte == current_byte) {
+		const uint32_t price = rep_match_price +
+			short_rep_price(lzma, state, pos_state);
+
+		if (price < opts[1].price) {
+			opts[1].price = price;
+			make_short_rep(&opts[1]);
+		}
+	}
+
+	len_end = max(len_main, rep_lens[rep_max_index]);
+	if (len_end < 2) {
+		*back_res = opts[1].back_prev;
+		*len_res = 1;
+		return 0;
+	}
+
+	opts[1].pos_prev = 0;
+	for (i = 0; i < LZMA_NUM_REPS; ++i)
+		opts[0].backs[i] = lzma->reps[i];
+
+	len = len_end;
+	do {
+		opts[len].price = RC_INFINITY_PRICE;
+	} while (--len >= 2);
+
+	for (i = 0; i < LZMA_NUM_REPS; ++i) {
+		uint32_t rep_len = rep_lens[i], price;
+
+		if (rep_len < 2)
+			continue;
+
+		price = rep_match_price +
+			pure_rep_price(lzma, i, state, pos_state);
+		do {
+			const uint32_t cur_and_len_price = price +
+				length_price(&lzma->repLenPrices,
+					     pos_state, rep_len);
+
+			if (cur_and_len_price < opts[rep_len].price) {
+				opts[rep_len].price = cur_and_len_price;
+				opts[rep_len].pos_prev = 0;
+				opts[rep_len].back_prev = i;
+				opts[rep_len].prev_1_is_literal = false;
+			}
+		} while (--rep_len >= 2);
+	}
+
+	normal_match_price = match_price + rc_bit_0_price(lzma->isRep[state]);
+
+	len = rep_lens[0] >= 2 ? rep_lens[0] + 1 : 2;
+	if (len <= len_main) {
+		i = 0;
+		while (len > matches[i].len)
+			++i;
+
+		for (; ; ++len) {
+			const uint32_t dist = matches[i].dist - 1;
+			const uint32_t cur_and_len_price = normal_match_price +
+				dist_len_price(lzma, dist, len, pos_state);
+
+			if (cur_and_len_price < opts[len].price) {
+				opts[len].price = cur_and_len_price;
+				opts[len].pos_prev = 0;
+				opts[len].back_prev = LZMA_NUM_REPS + dist;
+				opts[len].prev_1_is_literal = false;
+			}
+
+			if (len == matches[i].len && ++i == matches_count)
+				break;
+		}
+	}
+	return len_end;
 }
 
-static int lzma_encoder_reset(struct lzma_encoder *lzma,
-			      const struct lzma_properties *props)
+/* relax all choices at opts[cur], return the new number of positions */
+static uint32_t optimum_next_position(struct lzma_encoder *lzma,
+				      uint32_t reps[LZMA_NUM_REPS],
+				      const uint8_t *ip, uint32_t len_end,
+				      const uint32_t position,
+				      const uint32_t cur,
+				      const uint32_t nice_len,
+				      const uint32_t avail_full)
 {
-	unsigned int i, j, oldlclp, lclp;
+	struct lzma_optimal *const opts = lzma->optimum.opts;
+	struct lzma_match *const matches = lzma->optimum.matches;
+	uint32_t matches_count = lzma->optimum.matches_count;
+	uint32_t new_len = matches_count ? matches[matches_count - 1].len : 0;
+	uint32_t pos_prev = opts[cur].pos_prev;
+	const uint32_t pos_state = position & lzma->pbMask;
+	uint32_t cur_price, cur_and_1_price, match_price, rep_match_price;
+	uint32_t avail, start_len, rep, i;
+	uint8_t current_byte, match_byte;
+	bool next_is_literal = false;
+	unsigned int state;
+
+	/* figure out the state and reps after the best path to opts[cur] */
+	if (opts[cur].prev_1_is_literal) {
+		--pos_prev;
+
+		if (opts[cur].prev_2) {
+			state = opts[opts[cur].pos_prev_2].state;
+
+			if (opts[cur].back_prev_2 < LZMA_NUM_REPS)
+				update_long_rep(state);
+			else
+				update_match(state);
+		} else {
+			state = opts[pos_prev].state;
+		}
+		update_literal(state);
+	} else {
+		state = opts[pos_prev].state;
+	}
 
-	lzma_mf_reset(&lzma->mf, &props->mf);
-	rc_reset(&lzma->rc);
+	if (pos_prev == cur - 1) {
+		if (is_short_rep(opts[cur]))
+			update_short_rep(state);
+		else
+			update_literal(state);
+	} else {
+		uint32_t back;
 
-	/* refer to "The main loop of decoder" of lzma specification */
-	lzma->state = 0;
-	lzma->reps[0] = lzma->reps[1] = lzma->reps[2] =
-		lzma->reps[3] = 1;
+		if (opts[cur].prev_1_is_literal && opts[cur].prev_2) {
+			pos_prev = opts[cur].pos_prev_2;
+			back = opts[cur].back_prev_2;
+			update_long_rep(state);
+		} else {
+			back = opts[cur].back_prev;
+			if (back < LZMA_NUM_REPS)
+				update_long_rep(state);
+			else
+				update_match(state);
+		}
+
+		if (back < LZMA_NUM_REPS) {
+			reps[0] = opts[pos_prev].backs[back];
 
-	/* reset all LZMA probability matrices */
-	for (i = 0; i < kNumStates; ++i) {
-		for (j = 0; j < LZMA_NUM_PB_STATES_MAX; ++j) {
-			lzma->isMatch[i][j] = kProbInitValue;
-			lzma->isRep0Long[i][j] = kProbInitValue;
+			for (i = 1; i <= back; ++i)
+				reps[i] = opts[pos_prev].backs[i - 1];
+			for (; i < LZMA_NUM_REPS; ++i)
+				reps[i] = opts[pos_prev].backs[i];
+		} else {
+			reps[0] = back - LZMA_NUM_REPS + 1;
+
+			for (i = 1; i < LZMA_NUM_REPS; ++i)
+				reps[i] = opts[pos_prev].backs[i - 1];
 		}
-		lzma->isRep[i] = kProbInitValue;
-		lzma->isRepG0[i] = kProbInitValue;
-		lzma->isRepG1[i] = kProbInitValue;
-		lzma->isRepG2[i] = kProbInitValue;
 	}
 
-	for (i = 0; i < kNumLenToPosStates; ++i)
-		for (j = 0; j < (1 << kNumPosSlotBits); j++)
-			lzma->posSlotEncoder[i][j] = kProbInitValue;
+	opts[cur].state = state;
+	for (i = 0; i < LZMA_NUM_REPS; ++i)
+		opts[cur].backs[i] = reps[i];
+
+	cur_price = opts[cur].price;
+	current_byte = *ip;
+	match_byte = *(ip - reps[0]);
+
+	/* try a literal */
+	cur_and_1_price = cur_price +
+		rc_bit_0_price(lzma->isMatch[state][pos_state]) +
+		literal_price(lzma, position, ip[-1], !is_literal_state(state),
+			      match_byte, current_byte);
+
+	if (cur_and_1_price < opts[cur + 1].price) {
+		opts[cur + 1].price = cur_and_1_price;
+		opts[cur + 1].pos_prev = cur;
+		make_literal(&opts[cur + 1]);
+		next_is_literal = true;
+	}
 
-	for (i = 0; i < ARRAY_SIZE(lzma->posEncoders); i++)
-		lzma->posEncoders[i] = kProbInitValue;
+	match_price = cur_price + rc_bit_1_price(lzma->isMatch[state][pos_state]);
+	rep_match_price = match_price + rc_bit_1_price(lzma->isRep[state]);
 
-	for (i = 0; i < ARRAY_SIZE(lzma->posAlignEncoder); i++)
-		lzma->posAlignEncoder[i] = kProbInitValue;
+	/* try a short rep */
+	if (match_byte == current_byte &&
+	    !(opts[cur + 1].pos_prev < cur && !opts[cur + 1].back_prev)) {
+		const uint32_t price = rep_match_price +
+			short_rep_price(lzma, state, pos_state);
 
-	/* set up LZMA literal probabilities */
-	oldlclp = lzma->lc + lzma->lp;
-	lclp = props->lc + props->lp;
-	lzma->lc = props->lc;
-	lzma->lp = props->lp;
+		if (price <= opts[cur + 1].price) {
+			opts[cur + 1].price = price;
+			opts[cur + 1].pos_prev = cur;
+			make_short_rep(&opts[cur + 1]);
+			next_is_literal = true;
+		}
+	}
 
-	if (lzma->literal && lclp != oldlclp) {
-		free(lzma->literal);
-		lzma->literal = NULL;
+	if (avail_full < 2)
+		return len_end;
+
+	avail = min(avail_full, nice_len);
+
+	/* try a literal + rep0 */
+	if (!next_is_literal && match_byte != current_byte) {
+		const uint8_t *const repp = ip - reps[0];
+		const uint32_t limit = min(avail_full, nice_len + 1);
+		const uint32_t len_test =
+			ez_memcmp(ip + 1, repp + 1, ip + limit) - ip - 1;
+
+		if (len_test >= 2) {
+			unsigned int state_2 = state;
+			uint32_t pos_state_next, price, offset;
+
+			update_literal(state_2);
+			pos_state_next = (position + 1) & lzma->pbMask;
+			price = cur_and_1_price +
+				rc_bit_1_price(lzma->isMatch[state_2][pos_state_next]) +
+				rc_bit_1_price(lzma->isRep[state_2]) +
+				rep_price(lzma, 0, len_test, state_2,
+					  pos_state_next);
+
+			offset = cur + 1 + len_test;
+			while (len_end < offset)
+				opts[++len_end].price = RC_INFINITY_PRICE;
+
+			if (price < opts[offset].price) {
+				opts[offset].price = price;
+				opts[offset].pos_prev = cur + 1;
+				opts[offset].back_prev = 0;
+				opts[offset].prev_1_is_literal = true;
+				opts[offset].prev_2 = false;
+			}
+		}
+	}
+
+	/* try rep matches (+ a literal + rep0) */
+	start_len = 2;
+	for (rep = 0; rep < LZMA_NUM_REPS; ++rep) {
+		const uint8_t *const repp = ip - reps[rep];
+		uint32_t len_test, len_test_2, limit, price;
+
+		if (get_unaligned16(ip) != get_unaligned16(repp))
+			continue;
+
+		len_test = ez_memcmp(ip + 2, repp + 2, ip + avail) - ip;
+		while (len_end < cur + len_test)
+			opts[++len_end].price = RC_INFINITY_PRICE;
+
+		price = rep_match_price +
+			pure_rep_price(lzma, rep, state, pos_state);
+
+		for (i = len_test; i >= 2; --i) {
+			const uint32_t cur_and_len_price = price +
+				length_price(&lzma->repLenPrices, pos_state, i);
+
+			if (cur_and_len_price < opts[cur + i].price) {
+				opts[cur + i].price = cur_and_len_price;
+				opts[cur + i].pos_prev = cur;
+				opts[cur + i].back_prev = rep;
+				opts[cur + i].prev_1_is_literal = false;
+			}
+		}
+
+		if (!rep)
+			start_len = len_test + 1;
+
+		len_test_2 = len_test + 1;
+		limit = min(avail_full, len_test_2 + nice_len);
+		if (len_test_2 < limit)
+			len_test_2 = ez_memcmp(ip + len_test_2,
+					       repp + len_test_2,
+					       ip + limit) - ip;
+		len_test_2 -= len_test + 1;
+
+		if (len_test_2 >= 2) {
+			unsigned int state_2 = state;
+			uint32_t pos_state_next, cur_and_len_price, offset;
+
+			update_long_rep(state_2);
+			pos_state_next = (position + len_test) & lzma->pbMask;
+
+			cur_and_len_price = price +
+				length_price(&lzma->repLenPrices, pos_state,
+					     len_test) +
+				rc_bit_0_price(lzma->isMatch[state_2][pos_state_next]) +
+				literal_price(lzma, position + len_test,
+					      ip[len_test - 1], true,
+					      repp[len_test], ip[len_test]);
+
+			update_literal(state_2);
+			pos_state_next = (position + len_test + 1) &
+				lzma->pbMask;
+
+			cur_and_len_price +=
+				rc_bit_1_price(lzma->isMatch[state_2][pos_state_next]) +
+				rc_bit_1_price(lzma->isRep[state_2]) +
+				rep_price(lzma, 0, len_test_2, state_2,
+					  pos_state_next);
+
+			offset = cur + len_test + 1 + len_test_2;
+			while (len_end < offset)
+				opts[++len_end].price = RC_INFINITY_PRICE;
+
+			if (cur_and_len_price < opts[offset].price) {
+				opts[offset].price = cur_and_len_price;
+				opts[offset].pos_prev = cur + len_test + 1;
+				opts[offset].back_prev = 0;
+				opts[offset].prev_1_is_literal = true;
+				opts[offset].prev_2 = true;
+				opts[offset].pos_prev_2 = cur;
+				opts[offset].back_prev_2 = rep;
+			}
+		}
+	}
+
+	/* try normal matches (+ a literal + rep0) */
+	if (new_len > avail) {
+		new_len = avail;
+
+		matches_count = 0;
+		while (new_len > matches[matches_count].len)
+			++matches_count;
+		matches[matches_count++].len = new_len;
 	}
 
-	if (!lzma->literal) {
-		lzma->literal = malloc((0x300 << lclp) * sizeof(probability));
-		if (!lzma->literal)
-			return -ENOMEM;
+	if (new_len >= start_len) {
+		const uint32_t normal_match_price = match_price +
+			rc_bit_0_price(lzma->isRep[state]);
+		uint32_t len_test;
+
+		while (len_end < cur + new_len)
+			opts[++len_end].price = RC_INFINITY_PRICE;
+
+		i = 0;
+		while (start_len > matches[i].len)
+			++i;
+
+		for (len_test = start_len; ; ++len_test) {
+			const uint32_t dist = matches[i].dist - 1;
+			uint32_t cur_and_len_price = normal_match_price +
+				dist_len_price(lzma, dist, len_test, pos_state);
+
+			if (cur_and_len_price < opts[cur + len_test].price) {
+				opts[cur + len_test].price = cur_and_len_price;
+				opts[cur + len_test].pos_prev = cur;
+				opts[cur + len_test].back_prev =
+					LZMA_NUM_REPS + dist;
+				opts[cur + len_test].prev_1_is_literal = false;
+			}
+
+			if (len_test == matches[i].len) {
+				const uint8_t *const matchp = ip - dist - 1;
+				uint32_t len_test_2 = len_test + 1;
+				const uint32_t limit =
+					min(avail_full, len_test_2 + nice_len);
+
+				if (len_test_2 < limit)
+					len_test_2 = ez_memcmp(ip + len_test_2,
+							matchp + len_test_2,
+							ip + limit) - ip;
+				len_test_2 -= len_test + 1;
+
+				if (len_test_2 >= 2) {
+					unsigned int state_2 = state;
+					uint32_t pos_state_next, offset;
+
+					update_match(state_2);
+					pos_state_next = (position + len_test) &
+						lzma->pbMask;
+
+					cur_and_len_price +=
+						rc_bit_0_price(lzma->isMatch[state_2][pos_state_next]) +
+						literal_price(lzma,
+							position + len_test,
+							ip[len_test - 1], true,
+							matchp[len_test],
+							ip[len_test]);
+
+					update_literal(state_2);
+					pos_state_next = (pos_state_next + 1) &
+						lzma->pbMask;
+
+					cur_and_len_price +=
+						rc_bit_1_price(lzma->isMatch[state_2][pos_state_next]) +
+						rc_bit_1_price(lzma->isRep[state_2]) +
+						rep_price(lzma, 0, len_test_2,
+							  state_2,
+							  pos_state_next);
+
+					offset = cur + len_test + 1 + len_test_2;
+					while (len_end < offset)
+						opts[++len_end].price =
+							RC_INFINITY_PRICE;
+
+					if (cur_and_len_price <
+					    opts[offset].price) {
+						opts[offset].price =
+							cur_and_len_price;
+						opts[offset].pos_prev =
+							cur + len_test + 1;
+						opts[offset].back_prev = 0;
+						opts[offset].prev_1_is_literal =
+							true;
+						opts[offset].prev_2 = true;
+						opts[offset].pos_prev_2 = cur;
+						opts[offset].back_prev_2 =
+							LZMA_NUM_REPS + dist;
+					}
+				}
+
+				if (++i == matches_count)
+					break;
+			}
+		}
 	}
+	return len_end;
+}
+
+/*
+ * Price-based optimal parser, which finds the cheapest sequence of symbols
+ * up to LZMA_OPTS positions ahead by dynamic programming and then returns
+ * them one by one. It shares the same convention of lzma_get_optimum_fast().
+ */
+static int lzma_get_optimum_normal(struct lzma_encoder *lzma,
+				   const uint32_t position,
+				   uint32_t *back_res, uint32_t *len_res)
+{
+	struct lzma_mf *const mf = &lzma->mf;
+	struct lzma_optimal *const opts = lzma->optimum.opts;
+	uint32_t reps[LZMA_NUM_REPS];
+	uint32_t back, cur;
+	int len_end;
+
+	/* return the symbols which have already been decided */
+	if (lzma->optimum.end_index != lzma->optimum.cur_index) {
+		const uint32_t i = lzma->optimum.cur_index;
+
+		*len_res = opts[i].pos_prev - i;
+		back = opts[i].back_prev;
+		lzma->optimum.cur_index = opts[i].pos_prev;
+		goto out;
+	}
+
+	if (lzma_need_input(lzma, LZMA_OPTS))
+		return -ERANGE;
+
+	/* refresh the distance prices if enough matches have been coded */
+	if (lzma->matchPriceCount >= 1 << 7)
+		fill_dist_prices(lzma);
+	if (lzma->alignPriceCount >= kAlignTableSize)
+		fill_align_prices(lzma);
+
+	len_end = optimum_first_position(lzma, position, &back, len_res);
+	if (len_end < 0)
+		return len_end;
+	if (!len_end)
+		goto out;
+
+	memcpy(reps, lzma->reps, sizeof(reps));
+	for (cur = 1; cur < len_end; ++cur) {
+		const uint8_t *ip;
+		int ret;
+
+		ret = lzma_mf_find(mf, lzma->optimum.matches, lzma->finish);
+		/* the end of input, go ahead with what has been parsed */
+		if (ret < 0)
+			break;
+
+		lzma->optimum.matches_count = ret;
+		if (ret && lzma->optimum.matches[ret - 1].len >= mf->nice_len)
+			break;
+
+		ip = mf->buffer + mf->cur - 1;
+		len_end = optimum_next_position(lzma, reps, ip, len_end,
+						position + cur, cur,
+						mf->nice_len,
+						min_t(uint32_t, mf->iend - ip,
+						      LZMA_OPTS - 1 - cur));
+	}
+	optimum_backward(lzma, &back, len_res, cur);
+out:
+	*back_res = back;
+	if (back != MARK_LIT)
+		return 0;
+	*len_res = 0;
+	return 1;
+}
+
+struct lzma_endstate {
+	struct lzma_length_encoder lenEnc;
+
+	probability simpleMatch[2];
+	probability posSlot[kNumPosSlotBits];
+	probability posAlign[kNumAlignBits];
+};
+
+static void encode_eopm_stateless(struct lzma_encoder *lzma,
+				  struct lzma_endstate *endstate)
+{
+	const uint32_t pos_state =
+		(lzma->mf.cur - lzma->mf.lookahead) & lzma->pbMask;
+	const unsigned int state = lzma->state;
+	unsigned int i;
+
+	endstate->simpleMatch[0] = lzma->isMatch[state][pos_state];
+	endstate->simpleMatch[1] = lzma->isRep[state];
+	endstate->lenEnc = lzma->lenEnc;
+
+	rc_bit(&lzma->rc, endstate->simpleMatch, 1);
+	rc_bit(&lzma->rc, endstate->simpleMatch + 1, 0);
+	length(&lzma->rc, &endstate->lenEnc, pos_state, kMatchMinLen);
+
+	for (i = 0; i < kNumPosSlotBits; ++i) {
+		endstate->posSlot[i] =
+			lzma->posSlotEncoder[0][(1 << (i + 1)) - 1];
+		rc_bit(&lzma->rc, endstate->posSlot + i, 1);
+	}
+
+	rc_direct(&lzma->rc, (1 << (30 - kNumAlignBits)) - 1,
+		  30 - kNumAlignBits);
+
+	for (i = 0; i < kNumAlignBits; ++i) {
+		endstate->posAlign[i] =
+			lzma->posAlignEncoder[(1 << (i + 1)) - 1];
+		rc_bit(&lzma->rc, endstate->posAlign + i, 1);
+	}
+}
+
+static void encode_eopm(struct lzma_encoder *lzma)
+{
+	const uint32_t pos_state =
+		(lzma->mf.cur - lzma->mf.lookahead) & lzma->pbMask;
+	const unsigned int state = lzma->state;
+
+	rc_bit(&lzma->rc, &lzma->isMatch[state][pos_state], 1);
+	rc_bit(&lzma->rc, &lzma->isRep[state], 0);
+	match(lzma, pos_state, UINT32_MAX, MATCH_LEN_MIN);
+}
+
+static int __flush_symbol_destsize(struct lzma_encoder *lzma)
+{
+	struct lzma_encoder_destsize *ds = lzma->dstsize;
+	uint8_t *op = lzma->op;
+	unsigned int symbols_size;
+	uint64_t esz;
+
+	rc_write_checkpoint(&lzma->rc, &ds->cp);
+	if (rc_encode(&lzma->rc, &lzma->op, lzma->oend))
+		goto err_enospc;
+
+	symbols_size = lzma->op - op;
+	if (lzma->need_eopm) {
+		/* measure the end marker and rc flush without touching probs */
+		struct lzma_rc_ckpt cp2;
+		struct lzma_endstate endstate;
+		uint8_t ending[LZMA_REQUIRED_INPUT_MAX + 5];
+		uint8_t *ep = ending;
+		bool overflow;
+
+		rc_write_checkpoint(&lzma->rc, &cp2);
+		encode_eopm_stateless(lzma, &endstate);
+		rc_flush(&lzma->rc);
+		overflow = rc_encode(&lzma->rc, &ep, ending + sizeof(ending));
+		rc_restore_checkpoint(&lzma->rc, &cp2);
+
+		/* too many pending 0xFF bytes, just give up on this symbol */
+		if (overflow)
+			goto err_enospc;
+		esz = ep - ending;
+	} else {
+		esz = rc_pending(&lzma->rc);
+	}
+
+	if (ds->capacity < symbols_size + esz)
+		goto err_enospc;
+	ds->capacity -= symbols_size;
+	return 0;
+
+err_enospc:
+	rc_restore_checkpoint(&lzma->rc, &ds->cp);
+	lzma->op = op;
+	return -ENOSPC;
+}
+
+/*
+ * Encode the queued symbols without checking each output byte if there is
+ * room for the pending bytes, a symbol (and the end marker) and rc flush.
+ */
+static bool lzma_rc_encode(struct lzma_encoder *lzma)
+{
+	if ((uint64_t)(lzma->oend - lzma->op) >=
+	    rc_pending(&lzma->rc) + 2 * LZMA_REQUIRED_INPUT_MAX) {
+		rc_encode_buffered(&lzma->rc, &lzma->op);
+		return false;
+	}
+	return rc_encode(&lzma->rc, &lzma->op, lzma->oend);
+}
+
+static int flush_symbol(struct lzma_encoder *lzma)
+{
+	if (lzma->rc.count && lzma->dstsize) {
+		/* the worst case of a symbol, the end marker and rc flush */
+		const uint64_t safemargin = rc_pending(&lzma->rc) +
+			(LZMA_REQUIRED_INPUT_MAX << !!lzma->need_eopm);
+		uint8_t *op;
+		bool ret;
+
+		if (lzma->dstsize->capacity < safemargin)
+			return __flush_symbol_destsize(lzma);
+
+		op = lzma->op;
+		ret = lzma_rc_encode(lzma);
+
+		lzma->dstsize->capacity -= lzma->op - op;
+		return ret ? -ENOSPC : 0;
+	}
+
+	return lzma_rc_encode(lzma) ? -ENOSPC : 0;
+}
+
+/* if the symbol of @len bytes would exceed the limits of the chunk */
+static bool lzma_chunk_full(struct lzma_encoder *lzma, uint32_t len)
+{
+	/* the symbol queued last, this one and rc flush */
+	const uint64_t csize = lzma->op - lzma->chunk.out +
+		rc_pending(&lzma->rc) + 2 * LZMA_REQUIRED_INPUT_MAX;
+
+	return lzma->chunk.usize + len > lzma->chunk.ulimit ||
+		csize > lzma->chunk.climit;
+}
+
+static int encode_symbol(struct lzma_encoder *lzma, uint32_t back,
+			 uint32_t len, uint32_t *position)
+{
+	int err;
+
+	/* end the chunk here, the symbol is kept in lzma->seq for the next */
+	if (lzma->chunk.climit &&
+	    lzma_chunk_full(lzma, back == MARK_LIT ? 1 : len))
+		return -ENOSPC;
+
+	err = flush_symbol(lzma);
+	if (!err) {
+		const uint32_t pos_state = *position & lzma->pbMask;
+		const unsigned int state = lzma->state;
+		struct lzma_mf *const mf = &lzma->mf;
+
+		lzma_stats_symbol(&lzma->stats, back, len);
+
+		/* keep what is needed to take the symbol back */
+		if (lzma->dstsize) {
+			struct lzma_encoder_destsize *ds = lzma->dstsize;
+
+			ds->back = back;
+			ds->len = (back == MARK_LIT ? 1 : len);
+			ds->state = state;
+			memcpy(ds->reps, lzma->reps, sizeof(lzma->reps));
+		}
+
+		if (back == MARK_LIT) {
+			/* literal i.e. 8-bit byte */
+			rc_bit(&lzma->rc, &lzma->isMatch[state][pos_state], 0);
+			literal(lzma, *position);
+			len = 1;
+		} else {
+			rc_bit(&lzma->rc, &lzma->isMatch[state][pos_state], 1);
+
+			if (back < LZMA_NUM_REPS) {
+				/* repeated match */
+				rc_bit(&lzma->rc, &lzma->isRep[state], 1);
+				rep_match(lzma, pos_state, back, len);
+			} else {
+				/* normal match */
+				rc_bit(&lzma->rc, &lzma->isRep[state], 0);
+				match(lzma, pos_state,
+				      back - LZMA_NUM_REPS, len);
+			}
+		}
+
+		/* len bytes has been consumed by encoder */
+		DBG_BUGON(mf->lookahead < len);
+		mf->lookahead -= len;
+		*position += len;
+		lzma->chunk.usize += len;
+	}
+	return err;
+}
+
+/*
+ * encode sequence (literal, match) in lzma->seq, which can be resumed
+ * later if it's interrupted by -ENOSPC.
+ */
+static int encode_sequence(struct lzma_encoder *lzma, uint32_t *position)
+{
+	int err;
+
+	while (lzma->seq.nlits) {
+		err = encode_symbol(lzma, MARK_LIT, 0, position);
+		if (err)
+			return err;
+		--lzma->seq.nlits;
+	}
+	if (!lzma->seq.len)	/* no match */
+		return 0;
+
+	err = encode_symbol(lzma, lzma->seq.back, lzma->seq.len, position);
+	if (!err)
+		lzma->seq.len = 0;
+	return err;
+}
+
+static int __lzma_encode(struct lzma_encoder *lzma)
+{
+	uint32_t pos32 = lzma->mf.cur - lzma->mf.lookahead;
+	int err;
+
+	do {
+		uint32_t back, len;
+		int nlits;
+
+		/* finish the sequence interrupted last time first */
+		if (lzma->seq.nlits || lzma->seq.len) {
+			err = encode_sequence(lzma, &pos32);
+			continue;
+		}
+
+		if (lzma->mode == LZMA_MODE_NORMAL)
+			nlits = lzma_get_optimum_normal(lzma, pos32,
+							&back, &len);
+		else
+			nlits = lzma_get_optimum_fast(lzma, &back, &len);
+
+		if (nlits < 0) {
+			err = nlits;
+			break;
+		}
+
+		lzma->seq.nlits = nlits;
+		lzma->seq.back = back;
+		lzma->seq.len = len;
+		err = encode_sequence(lzma, &pos32);
+	} while (!err);
+	return err;
+}
+
+/* flush the last symbol, and then the end marker if needed */
+static int __lzma_encode_finish(struct lzma_encoder *lzma)
+{
+	if (!lzma->ended) {
+		if (lzma_rc_encode(lzma))
+			return -ENOSPC;
+
+		if (lzma->need_eopm)
+			encode_eopm(lzma);
+		rc_flush(&lzma->rc);
+		lzma->ended = true;
+		lzma_stats_dump(&lzma->stats, &lzma->mf.stats);
+	}
+	return lzma_rc_encode(lzma) ? -ENOSPC : 0;
+}
+
+/* encode a symbol at the current position and take it back if it overflows */
+static bool lzma_destsize_try(struct lzma_encoder *lzma,
+			      uint32_t back, uint32_t len)
+{
+	struct lzma_encoder_destsize *ds = lzma->dstsize;
+	uint32_t position = lzma->mf.cur - lzma->mf.lookahead;
+
+	/* nothing is pending, so encode_symbol() doesn't output anything */
+	if (!encode_symbol(lzma, back, len, &position) && !flush_symbol(lzma))
+		return true;
+
+	lzma->state = ds->state;
+	memcpy(lzma->reps, ds->reps, sizeof(lzma->reps));
+	lzma->mf.lookahead += ds->len;
+	return false;
+}
+
+/*
+ * The symbol queued last doesn't fit in the output, which has been rolled
+ * back to the checkpoint. Instead of stopping right here, try a bounded
+ * number of cheaper symbols (shorter matches, short reps and literals) to
+ * squeeze a few more input bytes into the remaining space.
+ */
+static void lzma_destsize_retry(struct lzma_encoder *lzma)
+{
+	struct lzma_encoder_destsize *ds = lzma->dstsize;
+	struct lzma_mf *mf = &lzma->mf;
+	uint32_t back = ds->back, len = ds->len, l;
+	/* don't try the same literal again */
+	bool litrejected = (back == MARK_LIT);
+	unsigned int tries;
+
+	lzma->state = ds->state;
+	memcpy(lzma->reps, ds->reps, sizeof(lzma->reps));
+	mf->lookahead += len;
+
+	/* l == 1 stands for a short rep, and l == 0 for a literal */
+	l = (back == MARK_LIT ? 1 : len - 1);
+	for (tries = 0; tries < LZMA_DESTSIZE_RETRIES; ++tries) {
+		const uint32_t position = mf->cur - mf->lookahead;
+		const uint8_t *ptr = mf->buffer + position;
+		uint32_t b = back;
+
+		if (l == 1 && (position < lzma->reps[0] ||
+			       *ptr != *(ptr - lzma->reps[0])))
+			l = 0;
+
+		if (l == 1) {
+			b = 0;
+		} else if (!l) {
+			if (litrejected)
+				break;
+			b = MARK_LIT;
+		}
+
+		if (!lzma_destsize_try(lzma, b, l)) {
+			if (!l)
+				break;
+			/* lengths are coded in 2-9, 10-17 and 18+ groups */
+			l = (l > 17 ? 17 : l > 9 ? 9 : l - 1);
+			continue;
+		}
+
+		/* go on with the rest of the match if any */
+		litrejected = false;
+		len -= max(l, 1U);
+		if (l >= MATCH_LEN_MIN)
+			back = 0;	/* the match distance is rep0 now */
+
+		if (!len) {
+			/* otherwise, try to add another byte */
+			if (!mf->lookahead) {
+				if (mf->buffer + mf->cur >= mf->iend)
+					break;
+				lzma_mf_skip(mf, 1);
+			}
+			back = MARK_LIT;
+			len = 1;
+		}
+		l = len;
+	}
+}
+
+int lzma_encoder_destsize(struct lzma_encoder *lzma, const uint8_t *in,
+			  uint32_t *insize, uint8_t *out, uint32_t outsize,
+			  bool eopm)
+{
+	struct lzma_encoder_destsize dstsize = { .capacity = outsize };
+	const bool need_eopm = lzma->need_eopm;
+	const uint8_t *ip = in, *iend = in + *insize;
+	struct lzma_mf *mf = &lzma->mf;
+	int err;
+
+	/* only a new stream (with a preset dictionary or not) is allowed */
+	if (mf->lookahead || mf->buffer + mf->cur != mf->iend || lzma->ended)
+		return -EBUSY;
+
+	lzma->dstsize = &dstsize;
+	lzma->need_eopm = eopm;
+	lzma->op = out;
+	lzma->oend = out + outsize;
+
+	do {
+		ip += lzma_mf_fill(mf, ip, iend - ip);
+		lzma->finish = (ip >= iend);
+		err = __lzma_encode(lzma);
+	} while (err == -ERANGE && !lzma->finish);
+
+	/* all input has been parsed, but the last symbol is still pending */
+	if (err == -ERANGE)
+		err = flush_symbol(lzma);
+
+	if (err == -ENOSPC) {
+		lzma_destsize_retry(lzma);
+		err = 0;
+	}
+
+	if (!err) {
+		if (eopm)
+			encode_eopm(lzma);
+		rc_flush(&lzma->rc);
+		lzma->ended = true;
+		lzma_stats_dump(&lzma->stats, &lzma->mf.stats);
+		/* only if even an empty stream doesn't fit */
+		if (rc_encode(&lzma->rc, &lzma->op, lzma->oend))
+			err = -ENOSPC;
+	}
+
+	/* the input which is left in the window hasn't been encoded */
+	*insize = ip - in - (mf->iend - (mf->buffer + mf->cur - mf->lookahead));
+	lzma->dstsize = NULL;
+	lzma->need_eopm = need_eopm;
+	return err ? err : lzma->op - out;
+}
+
+/* reset the state, reps and probabilities of @props, but keep the window */
+static int lzma_encoder_reset_probs(struct lzma_encoder *lzma,
+				    const struct lzma_properties *props)
+{
+	unsigned int i, lclp;
+
+	/* refer to "The main loop of decoder" of lzma specification */
+	lzma->state = 0;
+	lzma->reps[0] = lzma->reps[1] = lzma->reps[2] =
+		lzma->reps[3] = 1;
+
+	/* reset all LZMA probability matrices but literals */
+	memcpy((uint8_t *)lzma + LZMA_PROBS_OFFSET, lzma_probs_init,
+	       LZMA_PROBS_SIZE);
+
+	/* set up LZMA literal probabilities, only reallocate if it grows */
+	lclp = props->lc + props->lp;
+	lzma->lc = props->lc;
+	lzma->lp = props->lp;
+
+	lzma->literal = lzma_reserve(props->allocator, lzma->literal,
+				     &lzma->literalcap,
+				     (0x300 << lclp) * sizeof(probability));
+	if (!lzma->literal)
+		return -ENOMEM;
 
 	for (i = 0; i < (0x300 << lclp); i++)
 		lzma->literal[i] = kProbInitValue;
@@ -743,135 +1854,374 @@ static int lzma_encoder_reset(struct lzma_encoder *lzma,
 	lzma->pbMask = (1 << props->pb) - 1;
 	lzma->lpMask = (0x100 << props->lp) - (0x100 >> props->lc);
 
-	lzma_length_encoder_reset(&lzma->lenEnc);
-	lzma_length_encoder_reset(&lzma->repLenEnc);
+	if (lzma->mode == LZMA_MODE_NORMAL) {
+		lzma->distTableSize = get_pos_slot(props->mf.dictsize - 1) + 1;
+		fill_dist_prices(lzma);
+		fill_align_prices(lzma);
+
+		lzma->lenPrices.table_size = props->mf.nice_len + 1 -
+			kMatchMinLen;
+		lzma->repLenPrices.table_size = lzma->lenPrices.table_size;
+		for (i = 0; i <= lzma->pbMask; ++i) {
+			length_update_prices(&lzma->lenPrices,
+					     &lzma->lenEnc, i);
+			length_update_prices(&lzma->repLenPrices,
+					     &lzma->repLenEnc, i);
+		}
+	}
+	return 0;
+}
+
+int lzma_encoder_reset(struct lzma_encoder *lzma,
+		       const struct lzma_properties *props)
+{
+	int err;
+
+	if (props->lc > 8 || props->lp > 4 || props->pb > LZMA_PB_MAX ||
+	    props->lazy > LZMA_LAZY_MAX)
+		return -EINVAL;
+
+	/* the literal table of another allocator can't be reused */
+	if (lzma->literal && props->allocator != lzma->mf.allocator) {
+		lzma_free(lzma->mf.allocator, lzma->literal, lzma->literalcap);
+		lzma->literal = NULL;
+	}
+
+	err = lzma_mf_reset(&lzma->mf, &props->mf, props->allocator);
+	if (err)
+		return err;
+	rc_reset(&lzma->rc);
+
+	lzma->ended = false;
+	lzma->seq.nlits = lzma->seq.len = 0;
+	lzma->chunk.climit = 0;
+	lzma_stats_reset(&lzma->stats, &lzma->mf.stats);
+
+	lzma->mode = props->mode;
+	lzma->optimum.cur_index = lzma->optimum.end_index = 0;
+
+	err = lzma_encoder_reset_probs(lzma, props);
+	if (err)
+		return err;
+	lzma->props = *props;
 	return 0;
 }
 
-void lzma_default_properties(struct lzma_properties *p, int level)
+/* turn a rep match into a normal match of the same distance */
+static void lzma_unrep(uint32_t *back, uint32_t len,
+		       uint32_t reps[LZMA_NUM_REPS])
 {
-	if (level < 0)
-		level = 5;
+	uint32_t dist, i;
 
-	p->lc = 3;
-	p->lp = 0;
-	p->pb = 2;
-	p->mf.nice_len = (level < 7 ? 32 : 64);	/* LZMA SDK numFastBytes */
-	p->mf.depth = (16 + (p->mf.nice_len >> 1)) >> 1;
+	if (*back == MARK_LIT)
+		return;
+
+	if (*back < LZMA_NUM_REPS) {
+		/* a short rep is a literal of the same byte */
+		if (len == 1) {
+			*back = MARK_LIT;
+			return;
+		}
+		i = *back;
+		dist = reps[i];
+		*back = LZMA_NUM_REPS + dist - 1;
+	} else {
+		i = LZMA_NUM_REPS - 1;
+		dist = *back - LZMA_NUM_REPS + 1;
+	}
+
+	/* update reps as the encoder would, for the following symbols */
+	for (; i; --i)
+		reps[i] = reps[i - 1];
+	reps[0] = dist;
 }
 
-#include <stdlib.h>
-#include <stdio.h>
-#include <fcntl.h>
-#include <unistd.h>
-
-#if 0
-const char text[] = "HABEABDABABABHHHEAAAAAAAA";
-#elif 0
-const char text[] = "abcde_bcdefgh_abcdefghxxxxxxx";
-#else
-const char text[] = "The only time we actually leave the path spinning is if we're truncating "
-"a small amount and don't actually free an extent, which is not a common "
-"occurrence.  We have to set the path blocking in order to add the "
-"delayed ref anyway, so the first extent we find we set the path to "
-"blocking and stay blocking for the duration of the operation.  With the "
-"upcoming file extent map stuff there will be another case that we have "
-"to have the path blocking, so just swap to blocking always.";
-#endif
+/*
+ * The symbols which have been decided but not encoded yet can refer to
+ * the reps of the current state. Turn them into normal matches (and short
+ * reps into literals) so that they are still valid after a state reset.
+ */
+static void lzma_unrep_pending(struct lzma_encoder *lzma)
+{
+	struct lzma_optimal *const opts = lzma->optimum.opts;
+	uint32_t reps[LZMA_NUM_REPS];
+	uint32_t i;
+
+	memcpy(reps, lzma->reps, sizeof(reps));
+	if (lzma->seq.len) {
+		lzma_unrep(&lzma->seq.back, lzma->seq.len, reps);
+		if (lzma->seq.back == MARK_LIT) {
+			++lzma->seq.nlits;
+			lzma->seq.len = 0;
+		}
+	}
 
-static const uint8_t lzma_header[] = {
-	0x5D,				/* LZMA model properties (lc, lp, pb) in encoded form */
-	0x00, 0x00, 0x80, 0x00,		/* Dictionary size (32-bit unsigned integer, little-endian) */
-	0xFF, 0xFF, 0xFF, 0xFF,
-	0xFF, 0xFF, 0xFF, 0xFF,		/* Uncompressed size (64-bit unsigned integer, little-endian) */
-};
+	for (i = lzma->optimum.cur_index; i != lzma->optimum.end_index;
+	     i = opts[i].pos_prev)
+		lzma_unrep(&opts[i].back_prev, opts[i].pos_prev - i, reps);
+}
+
+int lzma_encoder_reset_state(struct lzma_encoder *lzma,
+			     const struct lzma_properties *props)
+{
+	struct lzma_properties p = lzma->props;
+	int err;
+
+	if (props->lc > 8 || props->lp > 4 || props->pb > LZMA_PB_MAX)
+		return -EINVAL;
+
+	p.lc = props->lc;
+	p.lp = props->lp;
+	p.pb = props->pb;
+
+	lzma_unrep_pending(lzma);
+	err = lzma_encoder_reset_probs(lzma, &p);
+	if (err)
+		return err;
+	lzma->props = p;
+	return 0;
+}
+
+void lzma_encoder_chunk_begin(struct lzma_encoder *lzma, uint8_t *out,
+			      uint32_t climit, uint32_t ulimit)
+{
+	lzma->op = out;
+	lzma->oend = out + climit;
+	lzma->chunk.out = out;
+	lzma->chunk.climit = climit;
+	lzma->chunk.ulimit = ulimit;
+	lzma->chunk.usize = 0;
+}
+
+int lzma_encoder_chunk(struct lzma_encoder *lzma,
+		       const uint8_t **in, const uint8_t *iend, bool finish,
+		       uint32_t *csize, const uint8_t **data, uint32_t *usize)
+{
+	struct lzma_mf *mf = &lzma->mf;
+	bool overflow;
+	int err;
+
+	while (1) {
+		*in += lzma_mf_fill(mf, *in, iend - *in);
+		lzma->finish = (finish && *in >= iend);
+
+		err = __lzma_encode(lzma);
+		if (err != -ERANGE || *in >= iend)
+			break;
+	}
+
+	if (err == -ERANGE && !lzma->finish)
+		return -ERANGE;
+	/* otherwise, the chunk is full (-ENOSPC) or all input is encoded */
+
+	/* the last symbol and rc flush always fit, see lzma_chunk_full() */
+	overflow = rc_encode(&lzma->rc, &lzma->op, lzma->oend);
+	rc_flush(&lzma->rc);
+	overflow |= rc_encode(&lzma->rc, &lzma->op, lzma->oend);
+	DBG_BUGON(overflow);
+
+	*csize = lzma->op - lzma->chunk.out;
+	*usize = lzma->chunk.usize;
+	*data = mf->buffer + mf->cur - mf->lookahead - *usize;
+	lzma->chunk.climit = 0;
+	return err == -ERANGE;
+}
+
+int lzma_encoder_chunk_peek(struct lzma_encoder *lzma,
+			    const uint8_t **in, const uint8_t *iend,
+			    bool finish, uint32_t limit,
+			    const uint8_t **data, uint32_t *usize)
+{
+	struct lzma_mf *mf = &lzma->mf;
+	uint32_t avail;
+
+	/* at most what fits in the window after the history kept */
+	limit = min(limit, mf->size - mf->max_distance - 16);
+
+	*in += lzma_mf_fill(mf, *in, iend - *in);
+	avail = mf->iend - (mf->buffer + mf->cur - mf->lookahead);
+	if (avail < limit && !(finish && *in >= iend))
+		return -ERANGE;
+
+	*usize = min(avail, limit);
+	*data = mf->buffer + mf->cur - mf->lookahead;
+	return finish && *in >= iend && *usize == avail;
+}
+
+int lzma_encoder_chunk_raw(struct lzma_encoder *lzma,
+			   const uint8_t **in, const uint8_t *iend,
+			   bool finish, uint32_t limit,
+			   const uint8_t **data, uint32_t *usize)
+{
+	struct lzma_mf *mf = &lzma->mf;
+	int ret;
+
+	ret = lzma_encoder_chunk_peek(lzma, in, iend, finish, limit,
+				      data, usize);
+	if (ret < 0)
+		return ret;
+
+	/* drop the symbols decided for the lookahead bytes */
+	lzma->seq.nlits = lzma->seq.len = 0;
+	lzma->optimum.cur_index = lzma->optimum.end_index = 0;
+
+	if (*usize > mf->lookahead)
+		lzma_mf_skip(mf, *usize - mf->lookahead);
+	mf->lookahead -= *usize;
+	return ret;
+}
 
-int main(int argc, char *argv[])
+const struct lzma_properties *
+lzma_encoder_properties(const struct lzma_encoder *lzma)
 {
-	char *outfile;
-	struct lzma_encoder lzmaenc = {0};
-	struct lzma_properties props = {
-		.mf.dictsize = 65536,
-	};
-	struct lzma_encoder_destsize dstsize;
+	return &lzma->props;
+}
 
-	unsigned int back_res = 0, len_res = 0;
-	unsigned int nliterals;
-	unsigned int position = 0;
-	uint8_t buf[4096];
-	int inf, outf;
+int lzma_encoder_preset_dict(struct lzma_encoder *lzma,
+			     const uint8_t *dict, uint32_t size)
+{
+	struct lzma_mf *mf = &lzma->mf;
 
+	if (mf->iend != mf->buffer)
+		return -EBUSY;
+
+	lzma_mf_preset_dict(mf, dict, size);
+	return 0;
+}
+
+struct lzma_encoder_dict {
+	struct lzma_mf_snapshot mf;
+};
+
+int lzma_encoder_dict_init(struct lzma_encoder_dict **dictp,
+			   const struct lzma_properties *props,
+			   const uint8_t *dict, uint32_t size)
+{
+	struct lzma_encoder_dict *d = malloc(sizeof(*d));
 	int err;
 
-	lzmaenc.mf.buffer = malloc(65536) + 1;
+	if (!d)
+		return -ENOMEM;
 
-	if (argc >= 3) {
-		int len;
+	err = lzma_mf_snapshot_init(&d->mf, &props->mf, dict, size);
+	if (err) {
+		free(d);
+		return err;
+	}
+	*dictp = d;
+	return 0;
+}
+
+int lzma_encoder_load_dict(struct lzma_encoder *lzma,
+			   const struct lzma_encoder_dict *dict)
+{
+	return lzma_mf_load_snapshot(&lzma->mf, &dict->mf);
+}
+
+void lzma_encoder_dict_end(struct lzma_encoder_dict *dict)
+{
+	lzma_mf_snapshot_end(&dict->mf);
+	free(dict);
+}
 
-		inf = open(argv[2], O_RDONLY);
+void lzma_default_properties(struct lzma_properties *p, int level)
+{
+	if (level < 0)
+		level = 5;
 
-		len = lseek(inf, 0, SEEK_END);
-		printf("len: %d\n", len);
+	p->lc = 3;
+	p->lp = 0;
+	p->pb = 2;
+	p->allocator = NULL;
+	p->mf.nice_len_min = p->mf.depth_min = 0;
+	p->mf.threaded = false;
+	p->mf.nice_len = (level < 7 ? 32 : 64);	/* LZMA SDK numFastBytes */
 
-		lseek(inf, 0, SEEK_SET);
-		read(inf, lzmaenc.mf.buffer, len);
-		close(inf);
-		lzmaenc.mf.iend = lzmaenc.mf.buffer + len;
+	if (level < 7) {
+		p->mode = LZMA_MODE_FAST;
+		/* trade some ratio for one cacheline per lookup at low levels */
+		p->mf.type = (level < 5 ? LZMA_MF_HB4 : LZMA_MF_HC4);
+		p->mf.depth = (16 + (p->mf.nice_len >> 1)) >> 1;
+		/* level 6 is in the middle, looking ahead by size estimates */
+		p->lazy = (level < 6 ? 0 : LZMA_LAZY_MAX);
 	} else {
-		memcpy(lzmaenc.mf.buffer, text, sizeof(text));
-		lzmaenc.mf.iend = lzmaenc.mf.buffer + sizeof(text);
+		/* the binary tree finds longer matches with less loops */
+		p->mode = LZMA_MODE_NORMAL;
+		p->lazy = 0;
+		p->mf.type = LZMA_MF_BT4;
+		p->mf.depth = 16 + (p->mf.nice_len >> 1);
 	}
-	lzmaenc.op = buf;
-	lzmaenc.oend = buf + sizeof(buf);
-	lzmaenc.finish = true;
+}
 
-	lzmaenc.need_eopm = true;
-	dstsize.capacity = 4096; //UINT32_MAX;
-	lzmaenc.dstsize = &dstsize;
+void lzma_encoder_header(const struct lzma_properties *p,
+			 uint8_t header[LZMA_HEADER_SIZE])
+{
+	const uint32_t dictsize = p->mf.dictsize;
 
+	/* LZMA model properties (lc, lp, pb) in encoded form */
+	header[0] = (p->pb * 5 + p->lp) * 9 + p->lc;
 
-	lzma_default_properties(&props, 5);
-	lzma_encoder_reset(&lzmaenc, &props);
+	/* dictionary size (32-bit unsigned integer, little-endian) */
+	header[1] = dictsize;
+	header[2] = dictsize >> 8;
+	header[3] = dictsize >> 16;
+	header[4] = dictsize >> 24;
 
-	err = __lzma_encode(&lzmaenc);
+	/* uncompressed size is unknown, the stream ends with an end marker */
+	memset(header + 5, 0xFF, 8);
+}
 
-	printf("%d\n", err);
+int lzma_encoder_init(struct lzma_encoder **lzmap,
+		      const struct lzma_properties *props)
+{
+	struct lzma_encoder *lzma = calloc(1, sizeof(*lzma));
+	int err;
 
-	rc_encode(&lzmaenc.rc, &lzmaenc.op, lzmaenc.oend);
+	if (!lzma)
+		return -ENOMEM;
 
-	if (err != -ERANGE) {
-		memcpy(lzmaenc.op, dstsize.ending, dstsize.esz);
-		lzmaenc.op += dstsize.esz;
-	} else {
-		encode_eopm(&lzmaenc);
-		rc_flush(&lzmaenc.rc);
+	err = lzma_encoder_reset(lzma, props);
+	if (err) {
+		lzma_encoder_end(lzma);
+		return err;
+	}
+	lzma->need_eopm = true;
+	*lzmap = lzma;
+	return 0;
+}
+
+int lzma_encoder_update(struct lzma_encoder *lzma,
+			const uint8_t **in, const uint8_t *iend,
+			uint8_t **out, uint8_t *oend,
+			enum lzma_action action)
+{
+	int err;
+
+	lzma->op = *out;
+	lzma->oend = oend;
+
+	while (1) {
+		*in += lzma_mf_fill(&lzma->mf, *in, iend - *in);
 
-		rc_encode(&lzmaenc.rc, &lzmaenc.op, lzmaenc.oend);
+		/* it can only be finished if all input is in the window */
+		lzma->finish = (action == LZMA_FINISH && *in >= iend);
+
+		err = __lzma_encode(lzma);
+		if (err != -ERANGE || *in >= iend)
+			break;
 	}
 
-	printf("encoded length: %u\n", lzmaenc.op - buf);
+	if (err == -ERANGE && lzma->finish)
+		err = __lzma_encode_finish(lzma);
 
-	if (argc < 2)
-		outfile = "output.bin.lzma";
-	else
-		outfile = argv[1];
-
-	outf = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	write(outf, lzma_header, sizeof(lzma_header));
-	write(outf, buf, lzmaenc.op - buf);
-	close(outf);
-
-#if 0
-	nliterals = lzma_get_optimum_fast(&lzmaenc, &back_res, &len_res);
-	printf("nlits %d (%d %d)\n", nliterals, back_res, len_res);
-	encode_sequence(&lzmaenc, nliterals, back_res, len_res, &position);
-	nliterals = lzma_get_optimum_fast(&lzmaenc, &back_res, &len_res);
-	printf("nlits %d (%d %d)\n", nliterals, back_res, len_res);
-	nliterals = lzma_get_optimum_fast(&lzmaenc, &back_res, &len_res);
-	printf("nlits %d (%d %d)\n", nliterals, back_res, len_res);
-	nliterals = lzma_get_optimum_fast(&lzmaenc, &back_res, &len_res);
-	printf("nlits %d (%d %d)\n", nliterals, back_res, len_res);
-#endif
+	*out = lzma->op;
+	return err;
 }
 
+void lzma_encoder_end(struct lzma_encoder *lzma)
+{
+	lzma_free(lzma->mf.allocator, lzma->literal, lzma->literalcap);
+	lzma_mf_end(&lzma->mf);
+	free(lzma);
+}
 
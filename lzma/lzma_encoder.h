@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/lzma_encoder.h - LZMA encoder interface for LZMA2 chunks
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#ifndef __EZ_LZMA_LZMA_ENCODER_H
+#define __EZ_LZMA_LZMA_ENCODER_H
+
+#include <ez/lzma.h>
+
+/*
+ * Start a chunk of at most @climit compressed bytes at @out and @ulimit
+ * uncompressed bytes, which goes on with the state of the last chunk.
+ */
+void lzma_encoder_chunk_begin(struct lzma_encoder *lzma, uint8_t *out,
+			      uint32_t climit, uint32_t ulimit);
+
+/*
+ * Encode [*in, iend) into the chunk until it's full or all input has been
+ * encoded (@finish). The range coder is flushed at the end of the chunk
+ * without an end marker, and [*data, *data + *usize) are the bytes encoded,
+ * which are kept in the window until the next call.
+ *
+ * Returns -ERANGE if more input is needed, 1 if all input has been encoded,
+ * or 0 if the chunk is full.
+ */
+int lzma_encoder_chunk(struct lzma_encoder *lzma,
+		       const uint8_t **in, const uint8_t *iend, bool finish,
+		       uint32_t *csize, const uint8_t **data, uint32_t *usize);
+
+/*
+ * Look at the next @limit bytes (or all the rest if @finish) without taking
+ * them. The same return values as above.
+ */
+int lzma_encoder_chunk_peek(struct lzma_encoder *lzma,
+			    const uint8_t **in, const uint8_t *iend,
+			    bool finish, uint32_t limit,
+			    const uint8_t **data, uint32_t *usize);
+
+/*
+ * Take the next @limit bytes (or all the rest if @finish) as they are, which
+ * are only hashed for later matches. The same return values as above.
+ */
+int lzma_encoder_chunk_raw(struct lzma_encoder *lzma,
+			   const uint8_t **in, const uint8_t *iend,
+			   bool finish, uint32_t limit,
+			   const uint8_t **data, uint32_t *usize);
+
+/*
+ * Reset the state and probabilities with lc, lp and pb of @props, but keep
+ * the window. It's needed before the next chunk after a raw chunk.
+ */
+int lzma_encoder_reset_state(struct lzma_encoder *lzma,
+			     const struct lzma_properties *props);
+
+#endif
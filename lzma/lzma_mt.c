@@ -0,0 +1,347 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/lzma_mt.c - block-parallel LZMA encoder
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ez/lzma.h>
+#include <ez/unaligned.h>
+
+#define LZMA_MT_BLOCKSIZE_MIN	(1U << 20)
+#define LZMA_MT_BLOCKSIZE_MAX	(1U << 31)
+
+enum lzma_mt_state {
+	LZMA_MT_FREE,	/* the block is unused or being filled */
+	LZMA_MT_BUSY,	/* the block is being compressed by its worker */
+	LZMA_MT_DONE,	/* the block is compressed and waits to be emitted */
+};
+
+struct lzma_mt_worker {
+	struct lzma_mt_encoder *mt;
+	pthread_t thread;
+	pthread_cond_t cond;
+
+	/* each worker owns an encoder (match finder tables, probabilities) */
+	struct lzma_encoder *lzma;
+	enum lzma_mt_state state;
+	int err;
+
+	/* the preset dictionary followed by the block data */
+	uint8_t *in;
+	uint32_t presetsize, insize;
+
+	/* the block header and the compressed data */
+	uint8_t *out;
+	size_t capacity, outsize, outpos;
+};
+
+struct lzma_mt_encoder {
+	struct lzma_properties props;
+	uint32_t blocksize;
+	bool preset_dict;
+
+	pthread_mutex_t lock;
+	/* signalled when a block is done */
+	pthread_cond_t done;
+	bool terminate;
+
+	/* the oldest block to be emitted and the block being filled */
+	unsigned int head, tail, inflight;
+	/* the block in the tail has been set up for filling */
+	bool filling;
+	uint64_t nblocks;
+
+	unsigned int nworkers;
+	struct lzma_mt_worker workers[];
+};
+
+static int lzma_mt_encode_block(struct lzma_mt_worker *w)
+{
+	const uint8_t *in = w->in + w->presetsize;
+	const uint8_t *iend = in + w->insize;
+	uint8_t *op;
+	int err;
+
+	err = lzma_encoder_reset(w->lzma, &w->mt->props);
+	if (err)
+		return err;
+
+	err = lzma_encoder_preset_dict(w->lzma, w->in, w->presetsize);
+	if (err)
+		return err;
+
+	op = w->out + LZMA_MT_BLOCK_HEADER_SIZE;
+	while (1) {
+		uint8_t *out;
+		size_t oldsize;
+
+		err = lzma_encoder_update(w->lzma, &in, iend, &op,
+					  w->out + w->capacity, LZMA_FINISH);
+		if (err != -ENOSPC)
+			break;
+
+		/* incompressible data, enlarge the output buffer */
+		oldsize = op - w->out;
+		out = realloc(w->out, w->capacity << 1);
+		if (!out)
+			return -ENOMEM;
+		w->out = out;
+		w->capacity <<= 1;
+		op = out + oldsize;
+	}
+	if (err)
+		return err;
+
+	w->outsize = op - w->out;
+	put_unaligned_le32(w->insize, w->out);
+	put_unaligned_le32(w->outsize - LZMA_MT_BLOCK_HEADER_SIZE,
+			   w->out + 4);
+	return 0;
+}
+
+static void *lzma_mt_worker_thread(void *arg)
+{
+	struct lzma_mt_worker *w = arg;
+	struct lzma_mt_encoder *mt = w->mt;
+
+	pthread_mutex_lock(&mt->lock);
+	while (1) {
+		int err;
+
+		while (w->state != LZMA_MT_BUSY && !mt->terminate)
+			pthread_cond_wait(&w->cond, &mt->lock);
+		if (mt->terminate)
+			break;
+		pthread_mutex_unlock(&mt->lock);
+
+		err = lzma_mt_encode_block(w);
+
+		pthread_mutex_lock(&mt->lock);
+		w->err = err;
+		w->state = LZMA_MT_DONE;
+		pthread_cond_signal(&mt->done);
+	}
+	pthread_mutex_unlock(&mt->lock);
+	return NULL;
+}
+
+/* set up the tail block, which starts with the previous block tail */
+static void lzma_mt_start_block(struct lzma_mt_encoder *mt)
+{
+	struct lzma_mt_worker *w = &mt->workers[mt->tail];
+	uint32_t presetsize = 0;
+
+	if (mt->preset_dict && mt->nblocks) {
+		/* it can be still being compressed, but only read here */
+		const struct lzma_mt_worker *prev = &mt->workers[
+			(mt->tail + mt->nworkers - 1) % mt->nworkers];
+		const uint32_t total = prev->presetsize + prev->insize;
+
+		presetsize = min(total, mt->props.mf.dictsize);
+		/* it's the same block if there is only one worker */
+		memmove(w->in, prev->in + total - presetsize, presetsize);
+	}
+	w->presetsize = presetsize;
+	w->insize = 0;
+	w->outpos = w->outsize = 0;
+	mt->filling = true;
+}
+
+static void lzma_mt_submit_block(struct lzma_mt_encoder *mt)
+{
+	struct lzma_mt_worker *w = &mt->workers[mt->tail];
+
+	pthread_mutex_lock(&mt->lock);
+	w->state = LZMA_MT_BUSY;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&mt->lock);
+
+	mt->tail = (mt->tail + 1) % mt->nworkers;
+	++mt->inflight;
+	++mt->nblocks;
+	mt->filling = false;
+}
+
+int lzma_mt_encoder_update(struct lzma_mt_encoder *mt,
+			   const uint8_t **in, const uint8_t *iend,
+			   uint8_t **out, uint8_t *oend,
+			   enum lzma_action action)
+{
+	while (1) {
+		struct lzma_mt_worker *w = &mt->workers[mt->head];
+
+		/* emit the oldest block in order */
+		if (mt->inflight) {
+			enum lzma_mt_state state;
+
+			pthread_mutex_lock(&mt->lock);
+			state = w->state;
+			pthread_mutex_unlock(&mt->lock);
+
+			if (state == LZMA_MT_DONE) {
+				size_t n;
+
+				if (w->err)
+					return w->err;
+
+				n = min_t(size_t, oend - *out,
+					  w->outsize - w->outpos);
+				memcpy(*out, w->out + w->outpos, n);
+				*out += n;
+				w->outpos += n;
+				if (w->outpos < w->outsize)
+					return -ENOSPC;
+
+				pthread_mutex_lock(&mt->lock);
+				w->state = LZMA_MT_FREE;
+				pthread_mutex_unlock(&mt->lock);
+				mt->head = (mt->head + 1) % mt->nworkers;
+				--mt->inflight;
+				continue;
+			}
+		}
+
+		/* fill the next block if there is a free worker */
+		if (mt->inflight < mt->nworkers) {
+			w = &mt->workers[mt->tail];
+
+			if (*in < iend) {
+				uint32_t n;
+
+				if (!mt->filling)
+					lzma_mt_start_block(mt);
+
+				n = min_t(size_t, mt->blocksize - w->insize,
+					  iend - *in);
+				memcpy(w->in + w->presetsize + w->insize,
+				       *in, n);
+				*in += n;
+				w->insize += n;
+				if (w->insize >= mt->blocksize)
+					lzma_mt_submit_block(mt);
+				continue;
+			}
+
+			if (action == LZMA_FINISH && mt->filling) {
+				lzma_mt_submit_block(mt);
+				continue;
+			}
+		}
+
+		if (*in >= iend && action == LZMA_RUN)
+			return -ERANGE;
+
+		if (!mt->inflight) {
+			/* the next stream doesn't refer to this one */
+			mt->nblocks = 0;
+			return 0;
+		}
+
+		/* wait for the oldest block */
+		w = &mt->workers[mt->head];
+		pthread_mutex_lock(&mt->lock);
+		while (w->state != LZMA_MT_DONE)
+			pthread_cond_wait(&mt->done, &mt->lock);
+		pthread_mutex_unlock(&mt->lock);
+	}
+}
+
+int lzma_mt_encoder_init(struct lzma_mt_encoder **mtp,
+			 const struct lzma_properties *props,
+			 const struct lzma_mt_options *opts)
+{
+	const uint32_t dictsize = props->mf.dictsize;
+	unsigned int threads = opts->threads;
+	struct lzma_mt_encoder *mt;
+	uint64_t blocksize;
+	uint32_t presetsize;
+	int err;
+
+	if (!threads) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = n > 0 ? n : 1;
+	}
+
+	blocksize = opts->blocksize;
+	if (!blocksize)
+		blocksize = max_t(uint64_t, 3ULL * dictsize,
+				  LZMA_MT_BLOCKSIZE_MIN);
+	if (blocksize > LZMA_MT_BLOCKSIZE_MAX)
+		return -EINVAL;
+
+	mt = calloc(1, sizeof(*mt) + threads * sizeof(mt->workers[0]));
+	if (!mt)
+		return -ENOMEM;
+
+	mt->props = *props;
+	mt->blocksize = blocksize;
+	mt->preset_dict = opts->preset_dict;
+	pthread_mutex_init(&mt->lock, NULL);
+	pthread_cond_init(&mt->done, NULL);
+
+	presetsize = mt->preset_dict ? dictsize : 0;
+	while (mt->nworkers < threads) {
+		struct lzma_mt_worker *w = &mt->workers[mt->nworkers];
+
+		w->mt = mt;
+		err = lzma_encoder_init(&w->lzma, props);
+		if (err)
+			goto err_out;
+
+		w->in = malloc((size_t)presetsize + blocksize);
+		w->capacity = LZMA_MT_BLOCK_HEADER_SIZE + blocksize +
+			(blocksize >> 4);
+		w->out = malloc(w->capacity);
+		if (!w->in || !w->out) {
+			err = -ENOMEM;
+			goto err_free_worker;
+		}
+
+		pthread_cond_init(&w->cond, NULL);
+		err = -pthread_create(&w->thread, NULL,
+				      lzma_mt_worker_thread, w);
+		if (err) {
+			pthread_cond_destroy(&w->cond);
+			goto err_free_worker;
+		}
+		++mt->nworkers;
+	}
+	*mtp = mt;
+	return 0;
+
+err_free_worker:
+	free(mt->workers[mt->nworkers].in);
+	free(mt->workers[mt->nworkers].out);
+	lzma_encoder_end(mt->workers[mt->nworkers].lzma);
+err_out:
+	lzma_mt_encoder_end(mt);
+	return err;
+}
+
+void lzma_mt_encoder_end(struct lzma_mt_encoder *mt)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&mt->lock);
+	mt->terminate = true;
+	for (i = 0; i < mt->nworkers; ++i)
+		pthread_cond_signal(&mt->workers[i].cond);
+	pthread_mutex_unlock(&mt->lock);
+
+	for (i = 0; i < mt->nworkers; ++i) {
+		struct lzma_mt_worker *w = &mt->workers[i];
+
+		pthread_join(w->thread, NULL);
+		pthread_cond_destroy(&w->cond);
+		lzma_encoder_end(w->lzma);
+		free(w->in);
+		free(w->out);
+	}
+	pthread_cond_destroy(&mt->done);
+	pthread_mutex_destroy(&mt->lock);
+	free(mt);
+}
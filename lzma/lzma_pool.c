@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/lzma_pool.c - a pool of LZMA encoders for small blocks
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#include <stdlib.h>
+#include <pthread.h>
+#include <ez/lzma.h>
+
+#define LZMA_POOL_MAX_IDLE_DEFAULT	64
+
+struct lzma_encoder_pool {
+	pthread_mutex_t lock;
+	unsigned int nidle, max_idle;
+	/* idle encoders which have been reset for a new stream */
+	struct lzma_encoder *idle[];
+};
+
+/*
+ * Encoders of the same properties (lc, lp, pb, dictsize and the mode and
+ * match finder settings derived from the level) can be reused as they are.
+ */
+static bool lzma_pool_match(const struct lzma_properties *a,
+			    const struct lzma_properties *b)
+{
+	return a->lc == b->lc && a->lp == b->lp && a->pb == b->pb &&
+		a->mode == b->mode && a->lazy == b->lazy &&
+		a->allocator == b->allocator &&
+		a->mf.dictsize == b->mf.dictsize && a->mf.type == b->mf.type &&
+		a->mf.nice_len == b->mf.nice_len && a->mf.depth == b->mf.depth &&
+		a->mf.nice_len_min == b->mf.nice_len_min &&
+		a->mf.depth_min == b->mf.depth_min &&
+		a->mf.threaded == b->mf.threaded;
+}
+
+int lzma_encoder_pool_init(struct lzma_encoder_pool **poolp,
+			   unsigned int max_idle)
+{
+	struct lzma_encoder_pool *pool;
+
+	if (!max_idle)
+		max_idle = LZMA_POOL_MAX_IDLE_DEFAULT;
+
+	pool = malloc(sizeof(*pool) + max_idle * sizeof(pool->idle[0]));
+	if (!pool)
+		return -ENOMEM;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->nidle = 0;
+	pool->max_idle = max_idle;
+	*poolp = pool;
+	return 0;
+}
+
+int lzma_encoder_pool_get(struct lzma_encoder_pool *pool,
+			  struct lzma_encoder **lzmap,
+			  const struct lzma_properties *props)
+{
+	struct lzma_encoder *lzma = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	/* the most recently put ones are more likely to be cache hot */
+	for (i = pool->nidle; i; --i) {
+		if (lzma_pool_match(lzma_encoder_properties(pool->idle[i - 1]),
+				    props)) {
+			lzma = pool->idle[i - 1];
+			pool->idle[i - 1] = pool->idle[--pool->nidle];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!lzma)
+		return lzma_encoder_init(lzmap, props);
+	*lzmap = lzma;
+	return 0;
+}
+
+void lzma_encoder_pool_put(struct lzma_encoder_pool *pool,
+			   struct lzma_encoder *lzma)
+{
+	/* reset out of the lock, it's only the probabilities and the hash */
+	if (!lzma_encoder_reset(lzma, lzma_encoder_properties(lzma))) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->nidle < pool->max_idle) {
+			pool->idle[pool->nidle++] = lzma;
+			lzma = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (lzma)
+		lzma_encoder_end(lzma);
+}
+
+void lzma_encoder_pool_end(struct lzma_encoder_pool *pool)
+{
+	while (pool->nidle)
+		lzma_encoder_end(pool->idle[--pool->nidle]);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/lzma_stats.h - encoder statistics for tuning
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ *
+ * Build with -DLZMA_STATS to record the symbol mix, match length and
+ * distance histograms and the match finder depth reached, which are
+ * dumped to stderr once per stream. Otherwise, it all compiles to nothing.
+ */
+#ifndef __EZ_LZMA_STATS_H
+#define __EZ_LZMA_STATS_H
+
+#include "lzma_common.h"
+
+#ifdef LZMA_STATS
+#include <stdio.h>
+
+/* enough for uint8_t depth in struct lzma_mf */
+#define LZMA_STATS_DEPTH_MAX	256
+
+struct lzma_mf_stats {
+	uint64_t finds;
+	/* the number of candidates visited for each find */
+	uint64_t depth[LZMA_STATS_DEPTH_MAX];
+};
+
+struct lzma_stats {
+	uint64_t literals, matches, shortreps;
+	uint64_t reps[LZMA_NUM_REPS];
+
+	uint64_t len[MATCH_LEN_MAX + 1];
+	/* distances in [2^i, 2^(i+1)) */
+	uint64_t dist[32];
+};
+
+static inline void lzma_mf_stats_depth(struct lzma_mf_stats *s,
+				       unsigned int depth)
+{
+	++s->finds;
+	++s->depth[depth];
+}
+
+static inline void lzma_stats_symbol(struct lzma_stats *s,
+				     uint32_t back, uint32_t len)
+{
+	if (back == MARK_LIT) {
+		++s->literals;
+		return;
+	}
+
+	if (back < LZMA_NUM_REPS) {
+		if (len == 1) {
+			++s->shortreps;
+			return;
+		}
+		++s->reps[back];
+	} else {
+		++s->matches;
+		/* back - LZMA_NUM_REPS is the distance - 1 */
+		++s->dist[31 - __builtin_clz(back - LZMA_NUM_REPS + 1)];
+	}
+	++s->len[len];
+}
+
+static inline void lzma_stats_reset(struct lzma_stats *s,
+				    struct lzma_mf_stats *mfs)
+{
+	memset(s, 0, sizeof(*s));
+	memset(mfs, 0, sizeof(*mfs));
+}
+
+static inline void lzma_stats_dump(struct lzma_stats *s,
+				   struct lzma_mf_stats *mfs)
+{
+	const uint64_t reps = s->reps[0] + s->reps[1] + s->reps[2] +
+		s->reps[3];
+	const uint64_t total = s->literals + s->matches + s->shortreps + reps;
+	unsigned int i;
+
+	fprintf(stderr, "lzma stats: %llu symbols, %llu literals, "
+		"%llu matches, %llu reps (%llu %llu %llu %llu), "
+		"%llu shortreps\n", (unsigned long long)total,
+		(unsigned long long)s->literals,
+		(unsigned long long)s->matches, (unsigned long long)reps,
+		(unsigned long long)s->reps[0], (unsigned long long)s->reps[1],
+		(unsigned long long)s->reps[2], (unsigned long long)s->reps[3],
+		(unsigned long long)s->shortreps);
+
+	fprintf(stderr, "match length:");
+	for (i = MATCH_LEN_MIN; i <= MATCH_LEN_MAX; ++i)
+		if (s->len[i])
+			fprintf(stderr, " %u:%llu", i,
+				(unsigned long long)s->len[i]);
+
+	fprintf(stderr, "\nmatch distance (log2):");
+	for (i = 0; i < ARRAY_SIZE(s->dist); ++i)
+		if (s->dist[i])
+			fprintf(stderr, " %u:%llu", i,
+				(unsigned long long)s->dist[i]);
+
+	fprintf(stderr, "\nmf depth reached (%llu finds):",
+		(unsigned long long)mfs->finds);
+	for (i = 0; i < LZMA_STATS_DEPTH_MAX; ++i)
+		if (mfs->depth[i])
+			fprintf(stderr, " %u:%llu", i,
+				(unsigned long long)mfs->depth[i]);
+	fputc('\n', stderr);
+	lzma_stats_reset(s, mfs);
+}
+#else
+#define lzma_mf_stats_depth(s, depth)		do {} while (0)
+#define lzma_stats_symbol(s, back, len)		do {} while (0)
+#define lzma_stats_reset(s, mfs)		do {} while (0)
+#define lzma_stats_dump(s, mfs)			do {} while (0)
+#endif
+
+#endif
+
@@ -0,0 +1,347 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/lzma_xz.c - .xz stream writer
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#include <stdlib.h>
+#include <ez/lzma.h>
+#include <ez/unaligned.h>
+#include "crc.h"
+
+#define XZ_HEADER_SIZE		12
+#define XZ_FOOTER_SIZE		12
+#define XZ_FILTER_LZMA2		0x21
+/* both sizes and one filter (LZMA2) fit in far less than the format max */
+#define XZ_BLOCK_HEADER_MAX	32
+/* block padding and the largest check */
+#define XZ_BLOCK_TAIL_MAX	(3 + 8)
+#define XZ_VLI_BYTES_MAX	9
+
+#define XZ_BLOCKSIZE_MIN	(1U << 20)
+#define XZ_BLOCKSIZE_MAX	(1U << 31)
+#define XZ_BUFSIZE_MIN		(1U << 16)
+
+enum lzma_xz_stage {
+	LZMA_XZ_HEADER,		/* the stream header is to be written */
+	LZMA_XZ_BLOCKS,
+	LZMA_XZ_DONE,		/* the index and the footer have been written */
+};
+
+/* an entry of the index */
+struct lzma_xz_record {
+	uint64_t unpadded, uncompressed;
+};
+
+struct lzma_xz_encoder {
+	struct lzma2_encoder *lzma2;
+	struct lzma_properties props;
+	enum lzma_check check;
+	uint32_t blocksize;
+
+	enum lzma_xz_stage stage;
+	/* the block being compressed into buf after XZ_BLOCK_HEADER_MAX */
+	bool inblock;
+	uint32_t insize;
+	uint64_t crc;
+
+	struct lzma_xz_record *records;
+	size_t nrecords, maxrecords;
+
+	/* a block, the stream header or the index and footer to write out */
+	uint8_t *buf;
+	size_t capacity, len;
+	size_t outpos, outsize;
+};
+
+static unsigned int xz_check_size(enum lzma_check check)
+{
+	return check == LZMA_CHECK_CRC64 ? 8 :
+		check == LZMA_CHECK_CRC32 ? 4 : 0;
+}
+
+/* variable-length integers are 7 bits per byte, least significant first */
+static unsigned int xz_put_vli(uint8_t *p, uint64_t v)
+{
+	unsigned int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+/* the LZMA2 dictionary size is encoded as 2^n or 2^n + 2^(n-1) */
+static uint8_t xz_lzma2_dict_size(uint32_t dictsize)
+{
+	uint8_t d;
+
+	for (d = 0; d < 40; ++d)
+		if (dictsize <= (uint32_t)(2 | (d & 1)) << (d / 2 + 11))
+			break;
+	return d;
+}
+
+static int xz_reserve(struct lzma_xz_encoder *xz, size_t size)
+{
+	size_t capacity = xz->capacity;
+	uint8_t *buf;
+
+	if (size <= capacity)
+		return 0;
+
+	while (capacity < size)
+		capacity <<= 1;
+	buf = realloc(xz->buf, capacity);
+	if (!buf)
+		return -ENOMEM;
+	xz->buf = buf;
+	xz->capacity = capacity;
+	return 0;
+}
+
+static void xz_write_header(struct lzma_xz_encoder *xz)
+{
+	static const uint8_t magic[6] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+	uint8_t *h = xz->buf;
+
+	memcpy(h, magic, sizeof(magic));
+	h[6] = 0x00;
+	h[7] = xz->check;
+	put_unaligned_le32(lzma_crc32(0, h + 6, 2), h + 8);
+	xz->outpos = 0;
+	xz->outsize = XZ_HEADER_SIZE;
+	xz->nrecords = 0;
+}
+
+/* put the block header in front of the data, and padding and check after */
+static int xz_finish_block(struct lzma_xz_encoder *xz)
+{
+	const uint64_t csize = xz->len - XZ_BLOCK_HEADER_MAX;
+	const unsigned int checksize = xz_check_size(xz->check);
+	uint8_t h[XZ_BLOCK_HEADER_MAX];
+	unsigned int n = 2;
+
+	n += xz_put_vli(h + n, csize);
+	n += xz_put_vli(h + n, xz->insize);
+	h[n++] = XZ_FILTER_LZMA2;
+	h[n++] = 1;		/* the size of filter properties */
+	h[n++] = xz_lzma2_dict_size(xz->props.mf.dictsize);
+	while (n & 3)
+		h[n++] = 0;
+
+	h[0] = n / 4;		/* (n + 4) / 4 - 1 */
+	h[1] = 0x40 | 0x80;	/* both sizes present, one filter */
+	put_unaligned_le32(lzma_crc32(0, h, n), h + n);
+	n += 4;
+	memcpy(xz->buf + XZ_BLOCK_HEADER_MAX - n, h, n);
+
+	while (xz->len & 3)
+		xz->buf[xz->len++] = 0;
+	if (xz->check == LZMA_CHECK_CRC64) {
+		put_unaligned_le32(xz->crc, xz->buf + xz->len);
+		put_unaligned_le32(xz->crc >> 32, xz->buf + xz->len + 4);
+	} else if (xz->check == LZMA_CHECK_CRC32) {
+		put_unaligned_le32(xz->crc, xz->buf + xz->len);
+	}
+	xz->len += checksize;
+
+	if (xz->nrecords >= xz->maxrecords) {
+		const size_t maxrecords = max_t(size_t, 16,
+						xz->maxrecords << 1);
+		struct lzma_xz_record *records;
+
+		records = realloc(xz->records, maxrecords * sizeof(*records));
+		if (!records)
+			return -ENOMEM;
+		xz->records = records;
+		xz->maxrecords = maxrecords;
+	}
+	xz->records[xz->nrecords++] = (struct lzma_xz_record) {
+		.unpadded = n + csize + checksize,
+		.uncompressed = xz->insize,
+	};
+
+	xz->outpos = XZ_BLOCK_HEADER_MAX - n;
+	xz->outsize = xz->len;
+	xz->inblock = false;
+	/* the next block can be decoded independently */
+	return lzma2_encoder_reset(xz->lzma2, &xz->props, true);
+}
+
+static int xz_write_index(struct lzma_xz_encoder *xz)
+{
+	uint8_t *p, *f;
+	size_t i, size;
+	int err;
+
+	err = xz_reserve(xz, 2 * XZ_VLI_BYTES_MAX * (xz->nrecords + 1) +
+			 XZ_FOOTER_SIZE);
+	if (err)
+		return err;
+
+	p = xz->buf;
+	*p++ = 0x00;		/* index indicator */
+	p += xz_put_vli(p, xz->nrecords);
+	for (i = 0; i < xz->nrecords; ++i) {
+		p += xz_put_vli(p, xz->records[i].unpadded);
+		p += xz_put_vli(p, xz->records[i].uncompressed);
+	}
+	while ((p - xz->buf) & 3)
+		*p++ = 0;
+	put_unaligned_le32(lzma_crc32(0, xz->buf, p - xz->buf), p);
+	p += 4;
+	size = p - xz->buf;
+
+	f = p;
+	put_unaligned_le32(size / 4 - 1, f + 4);	/* backward size */
+	f[8] = 0x00;
+	f[9] = xz->check;
+	put_unaligned_le32(lzma_crc32(0, f + 4, 6), f);
+	f[10] = 'Y';
+	f[11] = 'Z';
+
+	xz->outpos = 0;
+	xz->outsize = size + XZ_FOOTER_SIZE;
+	return 0;
+}
+
+int lzma_xz_encoder_update(struct lzma_xz_encoder *xz,
+			   const uint8_t **in, const uint8_t *iend,
+			   uint8_t **out, uint8_t *oend,
+			   enum lzma_action action)
+{
+	while (1) {
+		const uint8_t *ip = *in, *ie = iend;
+		uint8_t *op;
+		bool full;
+		int err;
+
+		if (xz->outpos < xz->outsize) {
+			const size_t n = min_t(size_t, oend - *out,
+					       xz->outsize - xz->outpos);
+
+			memcpy(*out, xz->buf + xz->outpos, n);
+			*out += n;
+			xz->outpos += n;
+			if (xz->outpos < xz->outsize)
+				return -ENOSPC;
+		}
+
+		if (xz->stage == LZMA_XZ_DONE) {
+			if (*in >= iend)
+				return 0;
+			xz->stage = LZMA_XZ_HEADER;	/* the next stream */
+		}
+
+		if (xz->stage == LZMA_XZ_HEADER) {
+			xz_write_header(xz);
+			xz->stage = LZMA_XZ_BLOCKS;
+			continue;
+		}
+
+		if (!xz->inblock) {
+			if (*in >= iend) {
+				if (action == LZMA_RUN)
+					return -ERANGE;
+
+				err = xz_write_index(xz);
+				if (err)
+					return err;
+				xz->stage = LZMA_XZ_DONE;
+				continue;
+			}
+			xz->inblock = true;
+			xz->len = XZ_BLOCK_HEADER_MAX;
+			xz->insize = 0;
+			xz->crc = 0;
+		}
+
+		full = (iend - ip >= xz->blocksize - xz->insize);
+		if (full)
+			ie = ip + (xz->blocksize - xz->insize);
+
+		op = xz->buf + xz->len;
+		err = lzma2_encoder_update(xz->lzma2, &ip, ie, &op,
+					   xz->buf + xz->capacity -
+					   XZ_BLOCK_TAIL_MAX,
+					   full ? LZMA_FINISH : action);
+
+		if (xz->check == LZMA_CHECK_CRC64)
+			xz->crc = lzma_crc64(xz->crc, *in, ip - *in);
+		else if (xz->check == LZMA_CHECK_CRC32)
+			xz->crc = lzma_crc32(xz->crc, *in, ip - *in);
+		xz->insize += ip - *in;
+		*in = ip;
+		xz->len = op - xz->buf;
+
+		if (err == -ENOSPC) {
+			err = xz_reserve(xz, xz->capacity << 1);
+			if (err)
+				return err;
+			continue;
+		}
+		if (err)
+			return err;
+
+		err = xz_finish_block(xz);
+		if (err)
+			return err;
+	}
+}
+
+int lzma_xz_encoder_init(struct lzma_xz_encoder **xzp,
+			 const struct lzma_properties *props,
+			 const struct lzma_xz_options *opts)
+{
+	struct lzma_xz_encoder *xz;
+	uint64_t blocksize;
+	int err;
+
+	if (opts->check != LZMA_CHECK_NONE &&
+	    opts->check != LZMA_CHECK_CRC32 &&
+	    opts->check != LZMA_CHECK_CRC64)
+		return -EINVAL;
+
+	blocksize = opts->blocksize;
+	if (!blocksize)
+		blocksize = max_t(uint64_t, 3ULL * props->mf.dictsize,
+				  XZ_BLOCKSIZE_MIN);
+	if (blocksize > XZ_BLOCKSIZE_MAX)
+		return -EINVAL;
+
+	xz = calloc(1, sizeof(*xz));
+	if (!xz)
+		return -ENOMEM;
+
+	err = lzma2_encoder_init(&xz->lzma2, props);
+	if (err) {
+		free(xz);
+		return err;
+	}
+
+	xz->capacity = XZ_BUFSIZE_MIN;
+	xz->buf = malloc(xz->capacity);
+	if (!xz->buf) {
+		lzma_xz_encoder_end(xz);
+		return -ENOMEM;
+	}
+
+	lzma_crc_init();
+	xz->props = *props;
+	xz->check = opts->check;
+	xz->blocksize = blocksize;
+	xz->stage = LZMA_XZ_HEADER;
+	*xzp = xz;
+	return 0;
+}
+
+void lzma_xz_encoder_end(struct lzma_xz_encoder *xz)
+{
+	lzma2_encoder_end(xz->lzma2);
+	free(xz->records);
+	free(xz->buf);
+	free(xz);
+}
@@ -0,0 +1,277 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/main.c - a simple .lzma compressor on the streaming interface
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ez/lzma.h>
+#include <ez/unaligned.h>
+
+#if 0
+const char text[] = "HABEABDABABABHHHEAAAAAAAA";
+#elif 0
+const char text[] = "abcde_bcdefgh_abcdefghxxxxxxx";
+#else
+const char text[] = "The only time we actually leave the path spinning is if we're truncating "
+"a small amount and don't actually free an extent, which is not a common "
+"occurrence.  We have to set the path blocking in order to add the "
+"delayed ref anyway, so the first extent we find we set the path to "
+"blocking and stay blocking for the duration of the operation.  With the "
+"upcoming file extent map stuff there will be another case that we have "
+"to have the path blocking, so just swap to blocking always.";
+#endif
+
+static uint8_t *load(const char *file, size_t *size)
+{
+	uint8_t *buf = NULL;
+	size_t len = 0;
+	int fd, ret;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	do {
+		uint8_t *nbuf = realloc(buf, len + 65536);
+
+		if (!nbuf) {
+			free(buf);
+			buf = NULL;
+			break;
+		}
+		buf = nbuf;
+		ret = read(fd, buf + len, 65536);
+		len += max(ret, 0);
+	} while (ret > 0);
+	close(fd);
+	*size = len;
+	return buf;
+}
+
+/*
+ * decompress outfile in 4KiB blocks and compare with the original input,
+ * each block of the block-parallel encoder is decoded with a new decoder.
+ */
+static int verify(const char *outfile, const uint8_t *orig, size_t origsize,
+		  bool mt)
+{
+	uint8_t header[LZMA_HEADER_SIZE];
+	uint8_t inbuf[65536], block[4096];
+	size_t pos = 0;
+	int outf, err;
+
+	outf = open(outfile, O_RDONLY);
+	if (outf < 0)
+		return -errno;
+
+	if (read(outf, header, sizeof(header)) != sizeof(header)) {
+		close(outf);
+		return -EIO;
+	}
+
+	do {
+		struct lzma_decoder *lzmadec;
+		const uint8_t *in = inbuf, *iend = inbuf;
+		size_t csize = SIZE_MAX, usize = SIZE_MAX;
+		const size_t start = pos;
+
+		if (mt) {
+			uint8_t bh[LZMA_MT_BLOCK_HEADER_SIZE];
+			int len = read(outf, bh, sizeof(bh));
+
+			if (!len) {
+				err = 0;
+				break;
+			}
+			if (len != sizeof(bh)) {
+				err = -EIO;
+				break;
+			}
+			usize = get_unaligned_le32(bh);
+			csize = get_unaligned_le32(bh + 4);
+		}
+
+		err = lzma_decoder_init(&lzmadec, header);
+		if (err)
+			break;
+
+		/* the preset dictionary is the previous tail of the input */
+		if (mt && pos) {
+			const uint32_t presetsize = min_t(size_t, pos,
+					get_unaligned_le32(header + 1));
+
+			err = lzma_decoder_preset_dict(lzmadec,
+						       orig + pos - presetsize,
+						       presetsize);
+		}
+
+		while (!err || err == -ENOSPC) {
+			uint8_t *op = block;
+
+			do {
+				if (in >= iend) {
+					int len = read(outf, inbuf,
+						min(sizeof(inbuf), csize));
+
+					if (len <= 0) {
+						err = -EIO;
+						goto out;
+					}
+					in = inbuf;
+					iend = inbuf + len;
+					csize -= len;
+				}
+				err = lzma_decoder_update(lzmadec, &in, iend,
+							  &op, block +
+							  sizeof(block));
+			} while (err == -ERANGE);
+
+			if (op - block > origsize - pos ||
+			    memcmp(block, orig + pos, op - block))
+				err = -EBADMSG;
+			pos += op - block;
+			if (err != -ENOSPC)
+				break;
+		}
+out:
+		lzma_decoder_end(lzmadec);
+
+		/* nothing of the block should be left */
+		if (!err && mt && (in < iend || csize || pos - start != usize))
+			err = -EBADMSG;
+	} while (!err && mt);
+
+	/* the original input should be all matched as well */
+	if (!err && pos != origsize)
+		err = -EBADMSG;
+	close(outf);
+	return err;
+}
+
+/* usage: a.out [outfile] [infile] [level] [threads] */
+int main(int argc, char *argv[])
+{
+	char *outfile;
+	struct lzma_encoder *lzmaenc = NULL;
+	struct lzma_mt_encoder *mtenc = NULL;
+	struct lzma_properties props;
+	uint8_t header[LZMA_HEADER_SIZE];
+	uint8_t inbuf[65536], outbuf[65536];
+	const uint8_t *in = inbuf, *iend = inbuf;
+	uint64_t total_in = 0, total_out = sizeof(header);
+	const uint8_t *orig;
+	size_t origsize;
+	const bool mt = argc >= 5;
+	int inf = -1, outf;
+	int err;
+
+	lzma_default_properties(&props, argc >= 4 ? atoi(argv[3]) : 5);
+	props.mf.dictsize = 65536;
+
+	if (mt) {
+		struct lzma_mt_options opts = {
+			.threads = atoi(argv[4]),
+			.preset_dict = true,
+		};
+
+		err = lzma_mt_encoder_init(&mtenc, &props, &opts);
+	} else {
+		err = lzma_encoder_init(&lzmaenc, &props);
+	}
+
+	if (err) {
+		fprintf(stderr, "failed to initialize encoder: %d\n", err);
+		return 1;
+	}
+
+	if (argc >= 3) {
+		inf = open(argv[2], O_RDONLY);
+		if (inf < 0) {
+			perror("open");
+			return 1;
+		}
+	} else {
+		in = (const uint8_t *)text;
+		iend = in + sizeof(text);
+	}
+
+	if (argc < 2)
+		outfile = "output.bin.lzma";
+	else
+		outfile = argv[1];
+
+	outf = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (outf < 0) {
+		perror("open");
+		return 1;
+	}
+
+	lzma_encoder_header(&props, header);
+	write(outf, header, sizeof(header));
+
+	do {
+		enum lzma_action action = LZMA_RUN;
+		uint8_t *op = outbuf;
+
+		if (in >= iend) {
+			int len = inf < 0 ? 0 : read(inf, inbuf, sizeof(inbuf));
+
+			in = inbuf;
+			iend = inbuf + max(len, 0);
+			total_in += iend - in;
+		}
+
+		if (inf < 0 || in >= iend)
+			action = LZMA_FINISH;
+
+		if (mt)
+			err = lzma_mt_encoder_update(mtenc, &in, iend, &op,
+						     outbuf + sizeof(outbuf),
+						     action);
+		else
+			err = lzma_encoder_update(lzmaenc, &in, iend, &op,
+						  outbuf + sizeof(outbuf),
+						  action);
+		write(outf, outbuf, op - outbuf);
+		total_out += op - outbuf;
+	} while (err == -ERANGE || err == -ENOSPC);
+
+	if (inf >= 0)
+		close(inf);
+	else
+		total_in = sizeof(text);
+	close(outf);
+	if (mt)
+		lzma_mt_encoder_end(mtenc);
+	else
+		lzma_encoder_end(lzmaenc);
+
+	if (err) {
+		fprintf(stderr, "failed to compress: %d\n", err);
+		return 1;
+	}
+	printf("%llu -> %llu\n", (unsigned long long)total_in,
+	       (unsigned long long)total_out);
+
+	if (argc >= 3) {
+		orig = load(argv[2], &origsize);
+		if (!orig) {
+			perror("load");
+			return 1;
+		}
+	} else {
+		orig = (const uint8_t *)text;
+		origsize = sizeof(text);
+	}
+
+	err = verify(outfile, orig, origsize, mt);
+	if (err) {
+		fprintf(stderr, "failed to verify: %d\n", err);
+		return 1;
+	}
+	return 0;
+}
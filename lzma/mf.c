@@ -5,11 +5,11 @@
  * Copyright (C) 2019 Gao Xiang <hsiangkao@aol.com>
  */
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <ez/unaligned.h>
 #include <ez/bitops.h>
 #include "mf.h"
 #include "bytehash.h"
-#include <stdio.h>
 
 #define LZMA_HASH_2_SZ		(1U << 10)
 #define LZMA_HASH_3_SZ		(1U << 16)
@@ -45,6 +45,28 @@ static void mf_move(struct lzma_mf *mf)
 
 	++mf->cur;
 	DBG_BUGON(mf->buffer + mf->cur > mf->iend);
+	lzma_mf_adapt_move(mf);
+}
+
+/* the chain entry of the position which is delta bytes back */
+static inline uint32_t mf_chain_index(const struct lzma_mf *mf, uint32_t delta)
+{
+	return mf->chaincur >= delta ? mf->chaincur - delta :
+		mf->max_distance + 1 + mf->chaincur - delta;
+}
+
+/* the hash buckets of the next position will be accessed soon */
+static inline void mf_prefetch_hash(const struct lzma_mf *mf,
+				    const uint8_t *ip)
+{
+	if (mf->iend - ip >= 5) {
+		const uint32_t dualhash = mt_calc_dualhash(ip + 1);
+
+		prefetch(&mf->hash[LZMA_HASH_3_BASE +
+				   mt_calc_hash_3(ip + 1, dualhash)]);
+		prefetch(&mf->hash[LZMA_HASH_4_BASE +
+				   mt_calc_hash_4(ip + 1, mf->hashbits)]);
+	}
 }
 
 static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
@@ -64,7 +86,7 @@ static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 	const uint32_t delta3 = pos - mf->hash[LZMA_HASH_3_BASE + hash_3];
 	const uint32_t hash_value = mt_calc_hash_4(ip, mf->hashbits);
 	uint32_t cur_match = mf->hash[LZMA_HASH_4_BASE + hash_value];
-	unsigned int bestlen, depth;
+	unsigned int bestlen, depth = mf->depth;
 	const uint8_t *matchend;
 	struct lzma_match *mp;
 
@@ -72,6 +94,13 @@ static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 	mf->hash[LZMA_HASH_3_BASE + hash_3] = pos;
 	mf->hash[LZMA_HASH_4_BASE + hash_value] = pos;
 	mf->chain[mf->chaincur] = cur_match;
+	mf_prefetch_hash(mf, ip);
+
+	/* the first candidate is likely to be a cache miss */
+	if (pos - cur_match <= mf->max_distance) {
+		prefetch(ip - (pos - cur_match));
+		prefetch(&mf->chain[mf_chain_index(mf, pos - cur_match)]);
+	}
 
 	mp = matches;
 	bestlen = 0;
@@ -84,8 +113,6 @@ static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 		*(mp++) = (struct lzma_match) { .len = bestlen,
 						.dist = delta2 };
 
-		printf("found match2: %d %d %d\n", mf->cur, delta2, bestlen);
-
 		if (matchend >= ilimit)
 			goto out;
 	}
@@ -93,13 +120,13 @@ static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 	/* check the 3-byte match */
 	if (delta2 != delta3 && delta3 <= mf->max_distance &&
 	    *(ip - delta3) == *ip) {
-		matchend = ez_memcmp(ip + 3, ip - delta3 + 3, ilimit);
+		matchend = ilimit <= ip + 3 ? ilimit :
+			ez_memcmp(ip + 3, ip - delta3 + 3, ilimit);
 
 		if (matchend - ip > bestlen) {
 			bestlen = matchend - ip;
 			*(mp++) = (struct lzma_match) { .len = bestlen,
 							.dist = delta3 };
-			printf("found match3: %d %d %d\n", mf->cur, delta3, bestlen);
 
 			if (matchend >= ilimit)
 				goto out;
@@ -107,7 +134,7 @@ static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 	}
 
 	/* check 4 or more byte matches, traversal the whole hash chain */
-	for (depth = mf->depth; depth; --depth) {
+	for (; depth; --depth) {
 		const uint32_t delta = pos - cur_match;
 		const uint8_t *match = ip - delta;
 		uint32_t nextcur;
@@ -115,13 +142,25 @@ static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 		if (delta > mf->max_distance)
 			break;
 
-		nextcur = (mf->chaincur >= delta ? mf->chaincur - delta :
-			   mf->max_distance + 1 + mf->chaincur - delta);
+		nextcur = mf_chain_index(mf, delta);
 		cur_match = mf->chain[nextcur];
 
+		/*
+		 * pipeline the walk: the window bytes of the next candidate
+		 * are needed in the next iteration, and its chain entry in
+		 * the one after that.
+		 */
+		if (pos - cur_match <= mf->max_distance) {
+			const uint32_t nextdelta = pos - cur_match;
+
+			prefetch(ip - nextdelta + bestlen);
+			prefetch(&mf->chain[mf_chain_index(mf, nextdelta)]);
+		}
+
 		if (get_unaligned32(match) == get_unaligned32(ip) &&
-		    match[bestlen + 1] == match[bestlen + 1]) {
-			matchend = ez_memcmp(ip + 4, match + 4, ilimit);
+		    match[bestlen] == ip[bestlen]) {
+			matchend = ilimit <= ip + 4 ? ilimit :
+				ez_memcmp(ip + 4, match + 4, ilimit);
 
 			if (matchend - ip <= bestlen)
 				continue;
@@ -130,24 +169,333 @@ static unsigned int lzma_mf_do_hc4_find(struct lzma_mf *mf,
 			*(mp++) = (struct lzma_match) { .len = bestlen,
 							.dist = delta };
 
-			printf("found match4: %d %d %d\n", mf->cur, delta, bestlen);
+			/* count the candidate just compared as visited */
+			if (matchend >= ilimit) {
+				--depth;
+				break;
+			}
+		}
+	}
 
-			if (matchend >= ilimit)
+out:
+	lzma_mf_stats_depth(&mf->stats, mf->depth - depth);
+	return mp - matches;
+}
+
+/* locate the bucket of the 4-byte hash and the tag of ip in the bucket */
+static inline struct lzma_mf_bucket *mf_hb_bucket(const struct lzma_mf *mf,
+						  const uint8_t *ip,
+						  uint8_t *tag)
+{
+	const uint32_t hash = mt_calc_hash_4(ip, 32);
+
+	/* the bits right below the bucket index are used as the tag */
+	*tag = hash >> (24 - mf->bucketbits);
+	return mf->bucket + (hash >> (32 - mf->bucketbits));
+}
+
+/* replace the oldest position of the bucket with the current one */
+static inline void mf_hb_insert(struct lzma_mf_bucket *b, uint32_t pos,
+				uint8_t tag)
+{
+	const uint32_t head = b->head;
+
+	b->pos[head] = pos;
+	b->tag[head] = tag;
+	b->head = (head + 1 < LZMA_MF_BUCKET_WAYS ? head + 1 : 0);
+}
+
+/* if any position has been inserted, the newest one isn't empty */
+static inline bool mf_hb_used(const struct lzma_mf_bucket *b)
+{
+	return b->pos[(b->head ? b->head : LZMA_MF_BUCKET_WAYS) - 1];
+}
+
+static unsigned int lzma_mf_do_hb4_find(struct lzma_mf *mf,
+					struct lzma_match *matches)
+{
+	const uint32_t cur = mf->cur;
+	const uint8_t *ip = mf->buffer + cur;
+	const uint32_t pos = cur + mf->offset;
+	const uint32_t nice_len = mf->nice_len;
+	const uint8_t *ilimit =
+		ip + nice_len < mf->iend ? ip + nice_len : mf->iend;
+
+	const uint32_t hash_2 = mt_calc_dualhash(ip) & (LZMA_HASH_2_SZ - 1);
+	const uint32_t delta2 = pos - mf->hash[hash_2];
+	const unsigned int ways = min_t(unsigned int, mf->depth,
+					LZMA_MF_BUCKET_WAYS);
+	struct lzma_mf_bucket *b;
+	unsigned int bestlen, depth, i;
+	const uint8_t *matchend;
+	struct lzma_match *mp;
+	uint8_t tag;
+
+	b = mf_hb_bucket(mf, ip, &tag);
+	mf->hash[hash_2] = pos;
+
+	/* the bucket of the next position will be accessed soon */
+	if (mf->iend - ip >= 5) {
+		uint8_t nexttag;
+
+		prefetch(mf_hb_bucket(mf, ip + 1, &nexttag));
+	}
+
+	mp = matches;
+	bestlen = 0;
+
+	/* check the 2-byte match */
+	if (delta2 <= mf->max_distance && *(ip - delta2) == *ip) {
+		matchend = ez_memcmp(ip + 2, ip - delta2 + 2, ilimit);
+
+		bestlen = matchend - ip;
+		*(mp++) = (struct lzma_match) { .len = bestlen,
+						.dist = delta2 };
+
+		if (matchend >= ilimit) {
+			depth = ways;
+			goto out;
+		}
+	}
+
+	/* check 4 or more byte matches from the newest to the oldest */
+	for (i = b->head, depth = ways; depth; --depth) {
+		uint32_t delta;
+		const uint8_t *match;
+
+		i = (i ? i : LZMA_MF_BUCKET_WAYS) - 1;
+		delta = pos - b->pos[i];
+
+		/* the rest are older (or empty) */
+		if (delta > mf->max_distance)
+			break;
+
+		if (b->tag[i] != tag)
+			continue;
+
+		match = ip - delta;
+		if (get_unaligned32(match) == get_unaligned32(ip) &&
+		    match[bestlen] == ip[bestlen]) {
+			matchend = ilimit <= ip + 4 ? ilimit :
+				ez_memcmp(ip + 4, match + 4, ilimit);
+
+			if (matchend - ip <= bestlen)
+				continue;
+
+			bestlen = matchend - ip;
+			*(mp++) = (struct lzma_match) { .len = bestlen,
+							.dist = delta };
+
+			/* count the candidate just compared as visited */
+			if (matchend >= ilimit) {
+				--depth;
 				break;
+			}
 		}
 	}
 
 out:
+	mf_hb_insert(b, pos, tag);
+	lzma_mf_stats_depth(&mf->stats, ways - depth);
+	return mp - matches;
+}
+
+/* get the (left, right) child links of the node which is delta bytes back */
+static inline uint32_t *mf_bt_node(struct lzma_mf *mf, uint32_t delta)
+{
+	const uint32_t cyclic = (mf->chaincur >= delta ? mf->chaincur - delta :
+				 mf->max_distance + 1 + mf->chaincur - delta);
+
+	return mf->chain + (cyclic << 1);
+}
+
+/*
+ * Walk the binary tree rooted at cur_match, record all matches longer than
+ * bestlen and re-root the tree at the current position at the same time.
+ */
+static struct lzma_match *mf_bt_find(struct lzma_mf *mf, uint32_t cur_match,
+				     const uint8_t *ip, uint32_t len_limit,
+				     unsigned int bestlen,
+				     struct lzma_match *mp)
+{
+	const uint32_t pos = mf->cur + mf->offset;
+	uint32_t *ptr0 = mf->chain + (mf->chaincur << 1) + 1;
+	uint32_t *ptr1 = mf->chain + (mf->chaincur << 1);
+	uint32_t len0 = 0, len1 = 0;
+	unsigned int depth;
+
+	for (depth = mf->depth; depth; --depth) {
+		const uint32_t delta = pos - cur_match;
+		const uint8_t *match = ip - delta;
+		uint32_t *pair, len;
+
+		if (delta > mf->max_distance)
+			break;
+
+		pair = mf_bt_node(mf, delta);
+		len = min(len0, len1);
+
+		if (match[len] == ip[len]) {
+			len = ez_memcmp(ip + len + 1, match + len + 1,
+					ip + len_limit) - ip;
+
+			if (len > bestlen) {
+				bestlen = len;
+				*(mp++) = (struct lzma_match) { .len = len,
+								.dist = delta };
+
+				if (len >= len_limit) {
+					*ptr1 = pair[0];
+					*ptr0 = pair[1];
+					lzma_mf_stats_depth(&mf->stats,
+							mf->depth - depth + 1);
+					return mp;
+				}
+			}
+		}
+
+		if (match[len] < ip[len]) {
+			*ptr1 = cur_match;
+			ptr1 = pair + 1;
+			cur_match = *ptr1;
+			len1 = len;
+		} else {
+			*ptr0 = cur_match;
+			ptr0 = pair;
+			cur_match = *ptr0;
+			len0 = len;
+		}
+	}
+	*ptr0 = *ptr1 = 0;
+	lzma_mf_stats_depth(&mf->stats, mf->depth - depth);
+	return mp;
+}
+
+/* the same as mf_bt_find(), but only re-root the tree without any match */
+static void mf_bt_skip(struct lzma_mf *mf, uint32_t cur_match,
+		       const uint8_t *ip, uint32_t len_limit)
+{
+	const uint32_t pos = mf->cur + mf->offset;
+	uint32_t *ptr0 = mf->chain + (mf->chaincur << 1) + 1;
+	uint32_t *ptr1 = mf->chain + (mf->chaincur << 1);
+	uint32_t len0 = 0, len1 = 0;
+	unsigned int depth;
+
+	for (depth = mf->depth; depth; --depth) {
+		const uint32_t delta = pos - cur_match;
+		const uint8_t *match = ip - delta;
+		uint32_t *pair, len;
+
+		if (delta > mf->max_distance)
+			break;
+
+		pair = mf_bt_node(mf, delta);
+		len = min(len0, len1);
+
+		if (match[len] == ip[len]) {
+			len = ez_memcmp(ip + len + 1, match + len + 1,
+					ip + len_limit) - ip;
+
+			if (len >= len_limit) {
+				*ptr1 = pair[0];
+				*ptr0 = pair[1];
+				return;
+			}
+		}
+
+		if (match[len] < ip[len]) {
+			*ptr1 = cur_match;
+			ptr1 = pair + 1;
+			cur_match = *ptr1;
+			len1 = len;
+		} else {
+			*ptr0 = cur_match;
+			ptr0 = pair;
+			cur_match = *ptr0;
+			len0 = len;
+		}
+	}
+	*ptr0 = *ptr1 = 0;
+}
+
+static unsigned int lzma_mf_do_bt4_find(struct lzma_mf *mf,
+					struct lzma_match *matches)
+{
+	const uint32_t cur = mf->cur;
+	const uint8_t *ip = mf->buffer + cur;
+	const uint32_t pos = cur + mf->offset;
+	const uint32_t nice_len = mf->nice_len;
+	const uint8_t *ilimit =
+		ip + nice_len < mf->iend ? ip + nice_len : mf->iend;
+
+	const uint32_t dualhash = mt_calc_dualhash(ip);
+	const uint32_t hash_2 = dualhash & (LZMA_HASH_2_SZ - 1);
+	const uint32_t delta2 = pos - mf->hash[hash_2];
+	const uint32_t hash_3 = mt_calc_hash_3(ip, dualhash);
+	const uint32_t delta3 = pos - mf->hash[LZMA_HASH_3_BASE + hash_3];
+	const uint32_t hash_value = mt_calc_hash_4(ip, mf->hashbits);
+	const uint32_t cur_match = mf->hash[LZMA_HASH_4_BASE + hash_value];
+	unsigned int bestlen;
+	const uint8_t *matchend;
+	struct lzma_match *mp;
+
+	mf->hash[hash_2] = pos;
+	mf->hash[LZMA_HASH_3_BASE + hash_3] = pos;
+	mf->hash[LZMA_HASH_4_BASE + hash_value] = pos;
+
+	mp = matches;
+	bestlen = 0;
+
+	/* check the 2-byte match */
+	if (delta2 <= mf->max_distance && *(ip - delta2) == *ip) {
+		matchend = ez_memcmp(ip + 2, ip - delta2 + 2, ilimit);
+
+		bestlen = matchend - ip;
+		*(mp++) = (struct lzma_match) { .len = bestlen,
+						.dist = delta2 };
+
+		if (matchend >= ilimit)
+			goto out_skip;
+	}
+
+	/* check the 3-byte match */
+	if (delta2 != delta3 && delta3 <= mf->max_distance &&
+	    *(ip - delta3) == *ip) {
+		matchend = ilimit <= ip + 3 ? ilimit :
+			ez_memcmp(ip + 3, ip - delta3 + 3, ilimit);
+
+		if (matchend - ip > bestlen) {
+			bestlen = matchend - ip;
+			*(mp++) = (struct lzma_match) { .len = bestlen,
+							.dist = delta3 };
+
+			if (matchend >= ilimit)
+				goto out_skip;
+		}
+	}
+
+	/* the binary tree only reports 4 or more byte matches */
+	mp = mf_bt_find(mf, cur_match, ip, ilimit - ip,
+			max(bestlen, 3U), mp);
+	return mp - matches;
+
+out_skip:
+	/* the tree still needs to be updated even if nice_len is reached */
+	mf_bt_skip(mf, cur_match, ip, ilimit - ip);
+	lzma_mf_stats_depth(&mf->stats, 0);
 	return mp - matches;
 }
 
-/* aka. lzma_mf_hc4_skip */
 void lzma_mf_skip(struct lzma_mf *mf, unsigned int bytetotal)
 {
 	const unsigned int hashbits = mf->hashbits;
 	unsigned int unhashedskip = mf->unhashedskip;
 	unsigned int bytecount = 0;
 
+	/* take what the thread has found, and go on serially if it stops */
+	if (mf->mt)
+		bytetotal = lzma_mf_mt_skip(mf, bytetotal);
+
 	if (unhashedskip) {
 		bytetotal += unhashedskip;
 		mf->cur -= unhashedskip;
@@ -160,7 +508,7 @@ void lzma_mf_skip(struct lzma_mf *mf, unsigned int bytetotal)
 
 	do {
 		const uint8_t *ip = mf->buffer + mf->cur;
-		uint32_t pos, dualhash, hash_2, hash_3, hash_value;
+		uint32_t pos, dualhash, hash_2, hash_3, hash_value, cur_match;
 
 		if (mf->iend - ip < 4) {
 			unhashedskip = bytetotal - bytecount;
@@ -176,37 +524,106 @@ void lzma_mf_skip(struct lzma_mf *mf, unsigned int bytetotal)
 		hash_2 = dualhash & (LZMA_HASH_2_SZ - 1);
 		mf->hash[hash_2] = pos;
 
+		if (mf->type == LZMA_MF_HB4) {
+			struct lzma_mf_bucket *b;
+			uint8_t tag;
+
+			b = mf_hb_bucket(mf, ip, &tag);
+			mf_hb_insert(b, pos, tag);
+			mf_move(mf);
+			continue;
+		}
+
 		hash_3 = mt_calc_hash_3(ip, dualhash);
 		mf->hash[LZMA_HASH_3_BASE + hash_3] = pos;
 
 		hash_value = mt_calc_hash_4(ip, hashbits);
-
-		mf->chain[mf->chaincur] =
-			mf->hash[LZMA_HASH_4_BASE + hash_value];
+		cur_match = mf->hash[LZMA_HASH_4_BASE + hash_value];
 		mf->hash[LZMA_HASH_4_BASE + hash_value] = pos;
 
+		if (mf->type == LZMA_MF_BT4)
+			mf_bt_skip(mf, cur_match, ip,
+				   min_t(uint32_t, mf->nice_len,
+					 mf->iend - ip));
+		else
+			mf->chain[mf->chaincur] = cur_match;
+
 		mf_move(mf);
 	} while (++bytecount < bytetotal);
 
 	mf->lookahead += bytetotal;
 }
 
-static int lzma_mf_hc4_find(struct lzma_mf *mf,
-			    struct lzma_match *matches, bool finish)
+/*
+ * Adapt nice_len and depth for the next region by how the matches found in
+ * this region went. If few positions have a match (incompressible data), or
+ * most matches reach nice_len anyway (highly repetitive data), walking less
+ * candidates hardly loses anything, so halve both. Otherwise double them
+ * back towards the bounds given by the caller.
+ *
+ * Only the positions taken by lzma_mf_find() are counted, and the new ones
+ * are taken LZMA_MF_ADAPT_REGION positions later, so that the thread of
+ * mf_mt.c (which runs ahead and never counts) takes them at the same
+ * position. Returns true if they are decided.
+ */
+bool lzma_mf_adapt(struct lzma_mf *mf, const struct lzma_match *matches,
+		   int ret)
+{
+	if (ret > 0) {
+		++mf->adapt.hits;
+		if (matches[ret - 1].len >= mf->nice_len)
+			++mf->adapt.nices;
+	}
+
+	if (++mf->adapt.finds < LZMA_MF_ADAPT_REGION)
+		return false;
+
+	/* the last ones have been taken, since this region is long enough */
+	DBG_BUGON(mf->adapt.pending);
+	if (mf->adapt.hits < mf->adapt.finds / 8 ||
+	    mf->adapt.nices > mf->adapt.hits / 2) {
+		mf->adapt.next_nice_len = max(mf->nice_len >> 1,
+					      mf->adapt.nice_len_min);
+		mf->adapt.next_depth = max_t(unsigned int, mf->depth >> 1,
+					     mf->adapt.depth_min);
+	} else {
+		mf->adapt.next_nice_len = min(mf->nice_len << 1,
+					      mf->adapt.nice_len_max);
+		mf->adapt.next_depth = min_t(unsigned int, mf->depth << 1,
+					     mf->adapt.depth_max);
+	}
+	mf->adapt.at = mf->adapt.count + LZMA_MF_ADAPT_REGION;
+	mf->adapt.pending = true;
+	mf->adapt.finds = mf->adapt.hits = mf->adapt.nices = 0;
+	return true;
+}
+
+static int __lzma_mf_find(struct lzma_mf *mf,
+			  struct lzma_match *matches, bool finish)
 {
+	const uint32_t avail = mf->iend - &mf->buffer[mf->cur];
 	int ret;
 
-	if (mf->iend - &mf->buffer[mf->cur] < 4) {
-		if (!finish)
-			return -ERANGE;
+	/* keep MATCH_LEN_MAX bytes lookahead unless it's the end of input */
+	if (!finish && avail < MATCH_LEN_MAX)
+		return -ERANGE;
 
+	if (avail < 4) {
 		mf->eod = true;
-		if (mf->buffer + mf->cur == mf->iend)
+		if (!avail)
 			return -ERANGE;
 	}
 
 	if (!mf->eod) {
-		ret = lzma_mf_do_hc4_find(mf, matches);
+		if (mf->type == LZMA_MF_BT4)
+			ret = lzma_mf_do_bt4_find(mf, matches);
+		else if (mf->type == LZMA_MF_HB4)
+			ret = lzma_mf_do_hb4_find(mf, matches);
+		else
+			ret = lzma_mf_do_hc4_find(mf, matches);
+
+		if (mf->adapt.depth_min)
+			lzma_mf_adapt(mf, matches, ret);
 	} else {
 		ret = 0;
 		/* ++mf->unhashedskip; */
@@ -220,7 +637,7 @@ static int lzma_mf_hc4_find(struct lzma_mf *mf,
 int lzma_mf_find(struct lzma_mf *mf, struct lzma_match *matches, bool finish)
 {
 	const uint8_t *ip = mf->buffer + mf->cur;
-	const uint8_t *iend = max((const uint8_t *)mf->iend,
+	const uint8_t *iend = min((const uint8_t *)mf->iend,
 				  ip + MATCH_LEN_MAX);
 	unsigned int i;
 	int ret;
@@ -229,15 +646,19 @@ int lzma_mf_find(struct lzma_mf *mf, struct lzma_match *matches, bool finish)
 	if (mf->unhashedskip)
 		lzma_mf_skip(mf, 0);
 
-	ret = lzma_mf_hc4_find(mf, matches, finish);
+	if (mf->mt && lzma_mf_mt_find(mf, matches, finish, &ret))
+		return ret;
+
+	ret = __lzma_mf_find(mf, matches, finish);
 	if (ret <= 0)
 		return ret;
 
 	i = ret;
 	do {
-		const uint8_t *cur = ip + matches[i].len;
+		const uint8_t *cur;
 
 		--i;
+		cur = ip + matches[i].len;
 		if (matches[i].len < mf->nice_len || cur >= iend)
 			break;
 
@@ -248,26 +669,232 @@ int lzma_mf_find(struct lzma_mf *mf, struct lzma_match *matches, bool finish)
 	return ret;
 }
 
-void lzma_mf_fill(struct lzma_mf *mf, const uint8_t *in, unsigned int size)
+/* the number of entries in mf->hash */
+static uint32_t mf_hashcount(enum lzma_mf_type type, unsigned int hashbits)
+{
+	if (type == LZMA_MF_HB4)
+		return LZMA_HASH_2_SZ;
+	return LZMA_HASH_4_BASE + (1 << hashbits);
+}
+
+/* the number of entries in mf->chain */
+static uint32_t mf_chaincount(enum lzma_mf_type type, uint32_t dictsize)
+{
+	if (type == LZMA_MF_HB4)
+		return 0;
+	/* LZMA_MF_BT4 keeps two child links for each position */
+	return dictsize << (type == LZMA_MF_BT4);
+}
+
+static void mf_subvalue(uint32_t *table, uint32_t count, uint32_t subvalue)
+{
+	uint32_t i;
+
+	/* positions which are too far away are treated as empty (0) */
+	for (i = 0; i < count; ++i)
+		table[i] = (table[i] <= subvalue ? 0 : table[i] - subvalue);
+}
+
+/* rebase all positions in the tables before 32-bit positions wrap around */
+static void mf_normalize(struct lzma_mf *mf)
+{
+	const uint32_t subvalue = mf->offset - (mf->max_distance + 1);
+	uint32_t i;
+
+	/*
+	 * The whole hash tables are rebased, since the part unused by this
+	 * stream can be used again by later streams (see lzma_mf_reset()).
+	 */
+	mf_subvalue(mf->hash, mf->hashcap / sizeof(mf->hash[0]), subvalue);
+	mf_subvalue(mf->chain, mf_chaincount(mf->type, mf->max_distance + 1),
+		    subvalue);
+
+	for (i = 0; i < mf->bucketcap / sizeof(mf->bucket[0]); ++i)
+		mf_subvalue(mf->bucket[i].pos, LZMA_MF_BUCKET_WAYS, subvalue);
+
+	mf->offset -= subvalue;
+}
+
+/*
+ * Drop the data which is no longer needed, that is, keep max_distance + 1
+ * bytes of history before the first byte not encoded yet. All positions in
+ * the tables are still valid by rebasing them through mf->offset.
+ */
+static void mf_move_window(struct lzma_mf *mf)
+{
+	const uint32_t keep = mf->max_distance + 1;
+	const uint32_t pos = mf->cur - mf->lookahead;
+	uint32_t move_offset;
+
+	if (pos <= keep)
+		return;
+
+	/* align to 16 bytes so that pos_state and literal positions remain */
+	move_offset = (pos - keep) & ~15U;
+	memmove(mf->buffer, mf->buffer + move_offset,
+		mf->iend - mf->buffer - move_offset);
+
+	mf->cur -= move_offset;
+	mf->iend -= move_offset;
+
+	if (mf->offset > UINT32_MAX - mf->size - move_offset)
+		mf_normalize(mf);
+	mf->offset += move_offset;
+}
+
+unsigned int lzma_mf_fill(struct lzma_mf *mf, const uint8_t *in,
+			  unsigned int size)
 {
 	DBG_BUGON(mf->buffer + mf->cur > mf->iend);
 
+	/* more input after all has been encoded (e.g. a LZMA2 chunk) */
+	if (size)
+		mf->eod = false;
+
 	/* move the sliding window in advance if needed */
-	//if (mf->cur >= mf->size - mf->keep_size_after)
-	//	move_window(mf);
+	if (size > mf->buffer + mf->size - mf->iend) {
+		if (mf->mt)
+			lzma_mf_mt_pause(mf);
+		mf_move_window(mf);
+	}
 
+	size = min_t(unsigned int, size, mf->buffer + mf->size - mf->iend);
 	memcpy(mf->iend, in, size);
 	mf->iend += size;
+
+	if (mf->mt)
+		lzma_mf_mt_fill(mf);
+	return size;
+}
+
+#define LZMA_HUGEPAGE_SIZE	(2U << 20)
+
+static void *lzma_hugepage_alloc(void *opaque, size_t size)
+{
+	const size_t mapsize = round_up(size, LZMA_HUGEPAGE_SIZE);
+	uint8_t *ptr, *aligned;
+
+	if (size < LZMA_HUGEPAGE_SIZE)
+		return aligned_alloc(64, round_up(size, 64));
+
+	/* map one more huge page to trim the unaligned head and tail */
+	ptr = mmap(NULL, mapsize + LZMA_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	aligned = (uint8_t *)round_up((uintptr_t)ptr, LZMA_HUGEPAGE_SIZE);
+	if (aligned > ptr)
+		munmap(ptr, aligned - ptr);
+	munmap(aligned + mapsize, ptr + LZMA_HUGEPAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+	/* it's only a hint, the tables still work on normal pages */
+	madvise(aligned, mapsize, MADV_HUGEPAGE);
+#endif
+	return aligned;
 }
 
-int lzma_mf_reset(struct lzma_mf *mf, const struct lzma_mf_properties *p)
+static void lzma_hugepage_free(void *opaque, void *ptr, size_t size)
+{
+	if (size < LZMA_HUGEPAGE_SIZE)
+		free(ptr);
+	else
+		munmap(ptr, round_up(size, LZMA_HUGEPAGE_SIZE));
+}
+
+const struct lzma_allocator lzma_hugepage_allocator = {
+	.alloc = lzma_hugepage_alloc,
+	.free = lzma_hugepage_free,
+};
+
+void *lzma_alloc(const struct lzma_allocator *allocator, size_t size)
+{
+	if (allocator)
+		return allocator->alloc(allocator->opaque, size);
+	return aligned_alloc(64, round_up(size, 64));
+}
+
+void lzma_free(const struct lzma_allocator *allocator, void *ptr, size_t size)
+{
+	if (!ptr)
+		return;
+	if (allocator)
+		allocator->free(allocator->opaque, ptr, size);
+	else
+		free(ptr);
+}
+
+/*
+ * Make sure that *cap bytes of ptr can hold size bytes, or replace it with
+ * a larger one (the old content is lost). Returns NULL if out of memory.
+ */
+void *lzma_reserve(const struct lzma_allocator *allocator, void *ptr,
+		   size_t *cap, size_t size)
+{
+	if (ptr && size <= *cap)
+		return ptr;
+
+	lzma_free(allocator, ptr, *cap);
+	ptr = lzma_alloc(allocator, size);
+	*cap = ptr ? size : 0;
+	return ptr;
+}
+
+static void mf_free_tables(struct lzma_mf *mf)
+{
+	if (mf->buffer)
+		lzma_free(mf->allocator, mf->buffer - 1, mf->buffercap);
+	lzma_free(mf->allocator, mf->hash, mf->hashcap);
+	lzma_free(mf->allocator, mf->chain, mf->chaincap);
+	lzma_free(mf->allocator, mf->bucket, mf->bucketcap);
+	mf->buffer = NULL;
+	mf->hash = mf->chain = NULL;
+	mf->bucket = NULL;
+	mf->buffercap = mf->hashcap = mf->chaincap = mf->bucketcap = 0;
+}
+
+/* the same as lzma_reserve(), but a new table is cleared (all empty) */
+static void *mf_reserve_table(struct lzma_mf *mf, void *ptr, size_t *cap,
+			      size_t size)
+{
+	const size_t oldcap = *cap;
+	void *table = lzma_reserve(mf->allocator, ptr, cap, size);
+
+	/* the address can be the same even if it's reallocated */
+	if (table && *cap != oldcap)
+		memset(table, 0, *cap);
+	return table;
+}
+
+int lzma_mf_reset(struct lzma_mf *mf, const struct lzma_mf_properties *p,
+		  const struct lzma_allocator *allocator)
 {
 	const uint32_t dictsize = p->dictsize;
 	unsigned int new_hashbits;
+	size_t hashsize, chainsize;
+	uint8_t *buffer;
+	uint64_t epoch;
+
+	if (!dictsize || p->nice_len < MATCH_LEN_MIN ||
+	    p->nice_len > MATCH_LEN_MAX) {
+		return -EINVAL;
+	}
 
-	if (!dictsize) {
+	/* both bounds are needed to adapt them, or neither */
+	if (!p->depth_min != !p->nice_len_min || p->depth_min > p->depth ||
+	    (p->nice_len_min &&
+	     (p->nice_len_min < MATCH_LEN_MIN || p->nice_len_min > p->nice_len)))
 		return -EINVAL;
-	} if (dictsize < UINT16_MAX) {
+
+	/* take the tables back from the thread (if any) before touching them */
+	if (mf->mt) {
+		if (p->threaded)
+			lzma_mf_mt_reset(mf);
+		else
+			lzma_mf_mt_end(mf);
+	}
+
+	if (dictsize < UINT16_MAX) {
 		new_hashbits = 16;
 	/* most significant set bit + 1 of distsize to derive hashbits */
 	} else {
@@ -278,40 +905,275 @@ int lzma_mf_reset(struct lzma_mf *mf, const struct lzma_mf_properties *p)
 			new_hashbits = 31;
 	}
 
-	if (new_hashbits != mf->hashbits ||
-	    mf->max_distance != dictsize - 1) {
-		if (mf->hash)
-			free(mf->hash);
-		if (mf->chain)
-			free(mf->chain);
-
-		mf->hashbits = 0;
-		mf->hash = calloc(LZMA_HASH_4_BASE + (1 << new_hashbits),
-				  sizeof(mf->hash[0]));
-		if (!mf->hash)
-			return -ENOMEM;
-
-		mf->chain = malloc(sizeof(mf->chain[0]) * (dictsize - 1));
-		if (!mf->chain) {
-			free(mf->hash);
-			return -ENOMEM;
-		}
-		mf->hashbits = new_hashbits;
+	/* tables of another allocator can't be reused */
+	if (allocator != mf->allocator) {
+		mf_free_tables(mf);
+		mf->allocator = allocator;
+	}
+
+	/*
+	 * All positions in the tables are below the end of the last stream
+	 * (if any), so start the new one dictsize bytes later, and they are
+	 * all too far away to be matched. Tables therefore don't need to be
+	 * cleared for each stream, but only when 32-bit positions are about
+	 * to wrap around (or if they are new).
+	 */
+	epoch = mf->buffer ? mf->offset + (uint64_t)(mf->iend - mf->buffer) : 0;
+
+	/*
+	 * The tables are kept across resets and only reallocated if they
+	 * grow, so that short streams don't pay for page faults again.
+	 */
+	/* dictsize bytes of history + reserved space to avoid frequent moves */
+	mf->size = dictsize + max(dictsize >> 1, LZMA_MF_RESERVE_MIN);
+	/* one more zeroed byte as the previous byte of the beginning */
+	buffer = lzma_reserve(allocator, mf->buffer ? mf->buffer - 1 : NULL,
+			      &mf->buffercap, mf->size + 1);
+	mf->buffer = buffer ? buffer + 1 : NULL;
+	if (!buffer)
+		goto err_nomem;
+	buffer[0] = 0;
+
+	hashsize = mf_hashcount(p->type, new_hashbits) * sizeof(mf->hash[0]);
+	mf->hash = mf_reserve_table(mf, mf->hash, &mf->hashcap, hashsize);
+	if (!mf->hash)
+		goto err_nomem;
+
+	/* chain entries are only followed from positions of this stream */
+	chainsize = mf_chaincount(p->type, dictsize) * sizeof(mf->chain[0]);
+	if (chainsize) {
+		mf->chain = lzma_reserve(allocator, mf->chain, &mf->chaincap,
+					 chainsize);
+		if (!mf->chain)
+			goto err_nomem;
+	}
+
+	if (p->type == LZMA_MF_HB4) {
+		/* about 1.5 bucket slots for each position */
+		const unsigned int bucketbits =
+			min(max(new_hashbits, 11U) - 3, 24U);
+
+		mf->bucket = mf_reserve_table(mf, mf->bucket, &mf->bucketcap,
+					      sizeof(mf->bucket[0]) <<
+					      bucketbits);
+		if (!mf->bucket)
+			goto err_nomem;
+		mf->bucketbits = bucketbits;
+	}
+	mf->hashbits = new_hashbits;
+	mf->type = p->type;
+
+	/* leave the same room as mf_move_window() before normalization */
+	if (epoch + dictsize > UINT32_MAX - mf->size) {
+		memset(mf->hash, 0, mf->hashcap);
+		if (mf->bucket)
+			memset(mf->bucket, 0, mf->bucketcap);
+		epoch = 0;
 	}
 
 	mf->max_distance = dictsize - 1;
 	/*
-	 * Set the initial value as mf->max_distance + 1.
+	 * Set the initial value at least as mf->max_distance + 1.
 	 * This would avoid hash zero initialization.
 	 */
-	mf->offset = mf->max_distance + 1;
+	mf->offset = epoch + mf->max_distance + 1;
 
 	mf->nice_len = p->nice_len;
 	mf->depth = p->depth;
+	mf->adapt.nice_len_min = p->nice_len_min;
+	mf->adapt.nice_len_max = p->nice_len;
+	mf->adapt.depth_min = p->depth_min;
+	mf->adapt.depth_max = p->depth;
+	mf->adapt.finds = mf->adapt.hits = mf->adapt.nices = 0;
+	mf->adapt.pending = false;
 
 	mf->cur = 0;
+	mf->iend = mf->buffer;
 	mf->lookahead = 0;
 	mf->chaincur = 0;
+	mf->unhashedskip = 0;
+	mf->eod = false;
+
+	if (p->threaded && !mf->mt)
+		return lzma_mf_mt_init(mf);
+	return 0;
+
+err_nomem:
+	/* start over with new tables next time */
+	mf_free_tables(mf);
+	mf->size = 0;
+	return -ENOMEM;
+}
+
+/* hash (the last dictsize bytes of) @dict as history rather than lookahead */
+void lzma_mf_preset_dict(struct lzma_mf *mf, const uint8_t *dict,
+			 uint32_t size)
+{
+	/* only the last dictsize bytes can be referenced */
+	if (size > mf->max_distance + 1) {
+		dict += size - (mf->max_distance + 1);
+		size = mf->max_distance + 1;
+	}
+
+	if (!size)
+		return;
+
+	lzma_mf_fill(mf, dict, size);
+	lzma_mf_skip(mf, size);
+	mf->lookahead -= size;
+}
+
+/* positions relative to the stream beginning are from 1 (0 = empty) */
+static inline uint32_t mf_snapshot_pos(uint32_t pos, uint32_t base)
+{
+	return pos > base ? pos - base : 0;
+}
+
+static inline uint32_t mf_restore_pos(uint32_t pos, uint32_t base)
+{
+	return pos ? pos + base : 0;
+}
+
+void lzma_mf_snapshot_end(struct lzma_mf_snapshot *s)
+{
+	free(s->window);
+	free(s->hash);
+	free(s->bucketindex);
+	free(s->bucket);
+	free(s->chain);
+	s->window = NULL;
+	s->hash = NULL;
+	s->bucketindex = NULL;
+	s->bucket = NULL;
+	s->chain = NULL;
+}
+
+int lzma_mf_snapshot_init(struct lzma_mf_snapshot *s,
+			  const struct lzma_mf_properties *p,
+			  const uint8_t *dict, uint32_t size)
+{
+	struct lzma_mf_properties sp = *p;
+	struct lzma_mf mf = {0};
+	uint32_t hashcount, base, i, j;
+	int err;
+
+	*s = (struct lzma_mf_snapshot) { .props = *p };
+
+	/* hash the dictionary on new tables, so all used entries are set */
+	sp.threaded = false;
+	err = lzma_mf_reset(&mf, &sp, NULL);
+	if (err)
+		return err;
+	lzma_mf_preset_dict(&mf, dict, size);
+
+	base = mf.offset - 1;
+	s->size = mf.iend - mf.buffer;
+	s->cur = mf.cur;
+	s->lookahead = mf.lookahead;
+	s->chaincur = mf.chaincur;
+	s->unhashedskip = mf.unhashedskip;
+
+	hashcount = mf_hashcount(mf.type, mf.hashbits);
+	for (i = 0; i < hashcount; ++i)
+		s->nhash += !!mf.hash[i];
+
+	for (i = 0; i < 1U << mf.bucketbits && mf.bucket; ++i)
+		s->nbucket += mf_hb_used(&mf.bucket[i]);
+
+	/* chain entries of all hashed positions, which start from 0 */
+	s->nchain = (s->cur - s->unhashedskip) << (mf.type == LZMA_MF_BT4);
+	if (mf.type == LZMA_MF_HB4)
+		s->nchain = 0;
+
+	err = -ENOMEM;
+	s->window = malloc(s->size);
+	s->hash = malloc(s->nhash * sizeof(s->hash[0]));
+	s->bucketindex = malloc(s->nbucket * sizeof(s->bucketindex[0]));
+	s->bucket = aligned_alloc(sizeof(s->bucket[0]),
+				  s->nbucket * sizeof(s->bucket[0]));
+	s->chain = malloc(s->nchain * sizeof(s->chain[0]));
+	if ((s->size && !s->window) || (s->nhash && !s->hash) ||
+	    (s->nbucket && (!s->bucketindex || !s->bucket)) ||
+	    (s->nchain && !s->chain))
+		goto out;
+
+	memcpy(s->window, mf.buffer, s->size);
+
+	for (i = j = 0; i < hashcount; ++i) {
+		if (!mf.hash[i])
+			continue;
+		s->hash[j].index = i;
+		s->hash[j++].pos = mf_snapshot_pos(mf.hash[i], base);
+	}
+
+	for (i = j = 0; i < 1U << mf.bucketbits && mf.bucket; ++i) {
+		struct lzma_mf_bucket *b = &s->bucket[j];
+		unsigned int k;
+
+		if (!mf_hb_used(&mf.bucket[i]))
+			continue;
+		*b = mf.bucket[i];
+		for (k = 0; k < LZMA_MF_BUCKET_WAYS; ++k)
+			b->pos[k] = mf_snapshot_pos(b->pos[k], base);
+		s->bucketindex[j++] = i;
+	}
+
+	for (i = 0; i < s->nchain; ++i)
+		s->chain[i] = mf_snapshot_pos(mf.chain[i], base);
+	err = 0;
+out:
+	if (err)
+		lzma_mf_snapshot_end(s);
+	lzma_mf_end(&mf);
+	return err;
+}
+
+/* copy a snapshot into a new stream instead of hashing the dictionary */
+int lzma_mf_load_snapshot(struct lzma_mf *mf,
+			  const struct lzma_mf_snapshot *s)
+{
+	const uint32_t base = mf->offset - 1;
+	uint32_t i;
+
+	if (mf->iend != mf->buffer)
+		return -EBUSY;
+
+	if (s->props.dictsize != mf->max_distance + 1 ||
+	    s->props.type != mf->type || s->props.nice_len != mf->nice_len ||
+	    s->props.depth != mf->depth)
+		return -EINVAL;
+
+	memcpy(mf->buffer, s->window, s->size);
+	mf->iend = mf->buffer + s->size;
+
+	/* the other entries are older than mf->offset, thus empty as well */
+	for (i = 0; i < s->nhash; ++i)
+		mf->hash[s->hash[i].index] = s->hash[i].pos + base;
+
+	for (i = 0; i < s->nbucket; ++i) {
+		struct lzma_mf_bucket *b = &mf->bucket[s->bucketindex[i]];
+		unsigned int k;
+
+		*b = s->bucket[i];
+		for (k = 0; k < LZMA_MF_BUCKET_WAYS; ++k)
+			b->pos[k] = mf_restore_pos(b->pos[k], base);
+	}
+
+	for (i = 0; i < s->nchain; ++i)
+		mf->chain[i] = mf_restore_pos(s->chain[i], base);
+
+	mf->cur = s->cur;
+	mf->lookahead = s->lookahead;
+	mf->chaincur = s->chaincur;
+	mf->unhashedskip = s->unhashedskip;
 	return 0;
 }
 
+void lzma_mf_end(struct lzma_mf *mf)
+{
+	if (mf->mt)
+		lzma_mf_mt_end(mf);
+	mf_free_tables(mf);
+	*mf = (struct lzma_mf) {0};
+}
+
@@ -8,13 +8,12 @@
 #define __LZMA_MF_H
 
 #include <ez/util.h>
+#include <ez/lzma.h>
 #include "lzma_common.h"
+#include "lzma_stats.h"
 
-struct lzma_mf_properties {
-	uint32_t dictsize;
-
-	uint32_t nice_len, depth;
-};
+/* the minimum space reserved in addition to dictsize for new input */
+#define LZMA_MF_RESERVE_MIN	(1U << 16)
 
 /*
  * an array used used by the LZ-based encoder to hold
@@ -25,6 +24,27 @@ struct lzma_match {
 	unsigned int dist;
 };
 
+/*
+ * the number of positions found before nice_len and depth are adapted, and
+ * also the number of positions later the new ones are taken from
+ */
+#define LZMA_MF_ADAPT_REGION	4096
+
+/* the number of recent positions kept in each bucket of LZMA_MF_HB4 */
+#define LZMA_MF_BUCKET_WAYS	12
+
+/*
+ * LZMA_MF_HB4 replaces the 4-byte hash and the chain with buckets of one
+ * cacheline each. A 8-bit tag of the hash is kept for each position, so
+ * that most candidates can be rejected without touching the window.
+ */
+struct lzma_mf_bucket {
+	uint32_t pos[LZMA_MF_BUCKET_WAYS];
+	uint8_t tag[LZMA_MF_BUCKET_WAYS];
+	/* the slot to be replaced next, which holds the oldest position */
+	uint32_t head;
+} __aligned(64);
+
 struct lzma_mf {
 	/* pointer to buffer with data to be compressed */
 	uint8_t *buffer;
@@ -32,6 +52,7 @@ struct lzma_mf {
 	/* size of the whole LZMA matchbuffer */
 	uint32_t size;
 
+	/* the position of buffer[0] used in hash / chain tables */
 	uint32_t offset;
 
 	/* indicate the next byte to run through the match finder */
@@ -46,9 +67,16 @@ struct lzma_mf {
 	/* indicate the number of bytes still not encoded */
 	uint32_t lookahead;
 
-	/* LZ matchfinder hash chain representation */
+	/*
+	 * LZ matchfinder hash chain representation, for LZMA_MF_BT4 each
+	 * chain entry is a pair of (left, right) child links instead.
+	 */
 	uint32_t *hash, *chain;
 
+	/* LZMA_MF_HB4 only keeps the 2-byte hash in hash[] besides these */
+	struct lzma_mf_bucket *bucket;
+	uint8_t bucketbits;
+
 	/* indicate the next byte in chain (0 ~ max_distance) */
 	uint32_t chaincur;
 	uint8_t hashbits;
@@ -56,6 +84,24 @@ struct lzma_mf {
 	/* maximum number of loops in the match finder */
 	uint8_t depth;
 
+	/* the bounds of nice_len and depth and the counters of this region */
+	struct {
+		uint32_t nice_len_min, nice_len_max;
+		uint8_t depth_min, depth_max;
+		uint32_t finds, hits, nices;
+
+		/*
+		 * the number of positions passed, and the next nice_len and
+		 * depth (if pending) which are taken once it reaches at
+		 */
+		uint32_t count, at;
+		uint32_t next_nice_len;
+		uint8_t next_depth;
+		bool pending;
+	} adapt;
+
+	enum lzma_mf_type type;
+
 #if 0
 	/*
 	 * maximum length of a match supported by the LZ-based encoder.
@@ -70,12 +116,85 @@ struct lzma_mf {
 	uint32_t unhashedskip;
 
 	bool eod;
+
+	/* the thread finding matches ahead if pipelined, see mf_mt.c */
+	struct lzma_mf_mt *mt;
+
+	/* the allocator and allocated sizes of the tables above */
+	const struct lzma_allocator *allocator;
+	size_t buffercap, hashcap, chaincap, bucketcap;
+
+#ifdef LZMA_STATS
+	struct lzma_mf_stats stats;
+#endif
+};
+
+/*
+ * The match finder state after hashing a preset dictionary, in which all
+ * positions are relative to the first byte of the stream (0 = empty), so
+ * that it can be copied into any new stream of the same properties.
+ */
+struct lzma_mf_snapshot {
+	struct lzma_mf_properties props;
+
+	/* the window, cur, chaincur, ... right after hashing */
+	uint8_t *window;
+	uint32_t size, cur, lookahead, chaincur, unhashedskip;
+
+	/* only used entries of the hash tables and buckets are kept */
+	uint32_t nhash, nbucket, nchain;
+	struct {
+		uint32_t index, pos;
+	} *hash;
+	uint32_t *bucketindex;
+	struct lzma_mf_bucket *bucket;
+	/* the chain (or child links) of the first nchain entries */
+	uint32_t *chain;
 };
 
+/* a position is passed, so take the next nice_len and depth in their turn */
+static inline void lzma_mf_adapt_move(struct lzma_mf *mf)
+{
+	if (++mf->adapt.count == mf->adapt.at && mf->adapt.pending) {
+		mf->nice_len = mf->adapt.next_nice_len;
+		mf->depth = mf->adapt.next_depth;
+		mf->adapt.pending = false;
+	}
+}
+
 int lzma_mf_find(struct lzma_mf *mf, struct lzma_match *matches, bool finish);
 void lzma_mf_skip(struct lzma_mf *mf, unsigned int n);
-void lzma_mf_fill(struct lzma_mf *mf, const uint8_t *in, unsigned int size);
-int lzma_mf_reset(struct lzma_mf *mf, const struct lzma_mf_properties *p);
+unsigned int lzma_mf_fill(struct lzma_mf *mf, const uint8_t *in,
+			  unsigned int size);
+int lzma_mf_reset(struct lzma_mf *mf, const struct lzma_mf_properties *p,
+		  const struct lzma_allocator *allocator);
+void lzma_mf_end(struct lzma_mf *mf);
+void lzma_mf_preset_dict(struct lzma_mf *mf, const uint8_t *dict,
+			 uint32_t size);
+
+int lzma_mf_snapshot_init(struct lzma_mf_snapshot *s,
+			  const struct lzma_mf_properties *p,
+			  const uint8_t *dict, uint32_t size);
+int lzma_mf_load_snapshot(struct lzma_mf *mf,
+			  const struct lzma_mf_snapshot *s);
+void lzma_mf_snapshot_end(struct lzma_mf_snapshot *s);
+bool lzma_mf_adapt(struct lzma_mf *mf, const struct lzma_match *matches,
+		   int ret);
+
+/* the pipelined match finder, only called by the serial one above */
+int lzma_mf_mt_init(struct lzma_mf *mf);
+void lzma_mf_mt_end(struct lzma_mf *mf);
+void lzma_mf_mt_reset(struct lzma_mf *mf);
+bool lzma_mf_mt_find(struct lzma_mf *mf, struct lzma_match *matches,
+		     bool finish, int *ret);
+unsigned int lzma_mf_mt_skip(struct lzma_mf *mf, unsigned int n);
+void lzma_mf_mt_pause(struct lzma_mf *mf);
+void lzma_mf_mt_fill(struct lzma_mf *mf);
+
+void *lzma_alloc(const struct lzma_allocator *allocator, size_t size);
+void lzma_free(const struct lzma_allocator *allocator, void *ptr, size_t size);
+void *lzma_reserve(const struct lzma_allocator *allocator, void *ptr,
+		   size_t *cap, size_t size);
 
 #endif
 
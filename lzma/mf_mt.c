@@ -0,0 +1,417 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/*
+ * ez/lzma/mf_mt.c - LZMA matchfinder pipelined on a thread of its own
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ *
+ * The thread finds matches for each position in order ahead of the encoder
+ * and passes them through a single-producer single-consumer ring, where
+ * the encoder takes them for lzma_mf_find() or drops them for lzma_mf_skip().
+ *
+ * Finding matches updates the tables in the same way as skipping, so the
+ * output is the same as the serial match finder's as long as each position
+ * is hashed with the same input available. The thread only takes positions
+ * with MATCH_LEN_MAX bytes of lookahead, which more input can't change, and
+ * the encoder takes the tables back for the rest (the end of input).
+ *
+ * If nice_len and depth are adapted, the encoder decides them by the records
+ * it takes, and the thread takes them at the same position as the encoder,
+ * which it can't reach before they are decided (see lzma_mf_adapt()).
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "mf.h"
+
+/* in struct lzma_match, each record is the number of matches and them */
+#define LZMA_MF_MT_RING_SIZE	(1U << 14)
+#define LZMA_MF_MT_RING_MASK	(LZMA_MF_MT_RING_SIZE - 1)
+
+/* polls before sleeping, since the other side is usually about to be done */
+#define LZMA_MF_MT_SPIN		64
+
+struct lzma_mf_mt {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* the match finder of the thread, which runs ahead of the encoder */
+	struct lzma_mf mf;
+
+	/*
+	 * The encoder owns the tables (serial) while the thread is parked,
+	 * which is requested by pause and acknowledged by parked.
+	 */
+	bool serial, pause, parked, stop;
+	/* how far the thread is ahead of the encoder when it's paused */
+	uint32_t ahead;
+
+	/* each side is going to sleep on cond until woken up by the other */
+	bool producer_waiting, consumer_waiting;
+	/* the end of input published to the thread */
+	uint8_t *iend;
+	/* stay less than a region ahead of the encoder to adapt the same */
+	bool adaptive;
+	/* the number of adapt decisions taken by the thread */
+	uint32_t decisions_taken;
+
+	/* the record found by the thread but not put into the ring yet */
+	uint32_t pending;
+	struct lzma_match matches[MATCH_LEN_MAX + 1];
+
+	/* free-running indexes of the ring */
+	uint32_t head __aligned(64);	/* written by the thread */
+	uint32_t tail __aligned(64);	/* written by the encoder */
+	/* the positions passed by the encoder, and its adapt decisions */
+	uint32_t consumed, decisions;
+	uint32_t next_at, next_nice_len;
+	uint8_t next_depth;
+	struct lzma_match ring[LZMA_MF_MT_RING_SIZE] __aligned(64);
+};
+
+/* a record of @need entries fits, or the next position can be found */
+static bool mf_mt_producer_ready(struct lzma_mf_mt *mt, uint32_t need)
+{
+	const uint8_t *iend;
+
+	if (__atomic_load_n(&mt->pause, __ATOMIC_ACQUIRE))
+		return true;
+
+	if (need)
+		return LZMA_MF_MT_RING_SIZE - (mt->head -
+			__atomic_load_n(&mt->tail, __ATOMIC_ACQUIRE)) >= need;
+
+	/* the next nice_len and depth can be taken after the next position */
+	if (mt->adaptive &&
+	    mt->mf.adapt.count - __atomic_load_n(&mt->consumed,
+						 __ATOMIC_ACQUIRE) >=
+	    LZMA_MF_ADAPT_REGION - 1)
+		return false;
+
+	iend = __atomic_load_n(&mt->iend, __ATOMIC_ACQUIRE);
+	return iend - (mt->mf.buffer + mt->mf.cur) >= MATCH_LEN_MAX;
+}
+
+static bool mf_mt_consumer_ready(struct lzma_mf_mt *mt, uint32_t unused)
+{
+	return __atomic_load_n(&mt->head, __ATOMIC_ACQUIRE) != mt->tail;
+}
+
+static void mf_mt_wait(struct lzma_mf_mt *mt, bool *waiting,
+		       bool (*ready)(struct lzma_mf_mt *mt, uint32_t arg),
+		       uint32_t arg)
+{
+	unsigned int spin;
+
+	for (spin = 0; spin < LZMA_MF_MT_SPIN; ++spin)
+		if (ready(mt, arg))
+			return;
+
+	pthread_mutex_lock(&mt->lock);
+	/* pairs with the fence of mf_mt_wake(), so a wakeup can't be lost */
+	__atomic_store_n(waiting, true, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (!ready(mt, arg))
+		pthread_cond_wait(&mt->cond, &mt->lock);
+	__atomic_store_n(waiting, false, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mt->lock);
+}
+
+static void mf_mt_wake(struct lzma_mf_mt *mt, bool *waiting)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&mt->lock);
+		pthread_cond_broadcast(&mt->cond);
+		pthread_mutex_unlock(&mt->lock);
+	}
+}
+
+static void mf_mt_put(struct lzma_mf_mt *mt, const struct lzma_match *matches,
+		      unsigned int n)
+{
+	uint32_t head = mt->head;
+	unsigned int i;
+
+	mt->ring[head++ & LZMA_MF_MT_RING_MASK] =
+		(struct lzma_match) { .len = n };
+	for (i = 0; i < n; ++i)
+		mt->ring[head++ & LZMA_MF_MT_RING_MASK] = matches[i];
+	__atomic_store_n(&mt->head, head, __ATOMIC_RELEASE);
+}
+
+/* take the nice_len and depth decided by the encoder (if any) */
+static void mf_mt_take_adapt(struct lzma_mf_mt *mt)
+{
+	const uint32_t decisions = __atomic_load_n(&mt->decisions,
+						   __ATOMIC_ACQUIRE);
+
+	if (decisions == mt->decisions_taken)
+		return;
+	mt->mf.adapt.at = mt->next_at;
+	mt->mf.adapt.next_nice_len = mt->next_nice_len;
+	mt->mf.adapt.next_depth = mt->next_depth;
+	mt->mf.adapt.pending = true;
+	mt->decisions_taken = decisions;
+}
+
+static void *mf_mt_thread(void *arg)
+{
+	struct lzma_mf_mt *mt = arg;
+
+	while (1) {
+		if (__atomic_load_n(&mt->pause, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_lock(&mt->lock);
+			mt->parked = true;
+			pthread_cond_broadcast(&mt->cond);
+			while (mt->pause && !mt->stop)
+				pthread_cond_wait(&mt->cond, &mt->lock);
+			mt->parked = false;
+			pthread_mutex_unlock(&mt->lock);
+
+			if (mt->stop)
+				break;
+			continue;
+		}
+
+		/* the number of entries of the pending record if any */
+		if (!mf_mt_producer_ready(mt, mt->pending)) {
+			mf_mt_wait(mt, &mt->producer_waiting,
+				   mf_mt_producer_ready, mt->pending);
+			continue;
+		}
+
+		if (!mt->pending) {
+			mt->mf.iend = __atomic_load_n(&mt->iend,
+						      __ATOMIC_ACQUIRE);
+			mf_mt_take_adapt(mt);
+			mt->pending = lzma_mf_find(&mt->mf, mt->matches,
+						   false) + 1;
+			DBG_BUGON(mt->pending > MATCH_LEN_MAX + 2);
+			continue;
+		}
+
+		mf_mt_put(mt, mt->matches, mt->pending - 1);
+		mt->pending = 0;
+		mf_mt_wake(mt, &mt->consumer_waiting);
+	}
+	return NULL;
+}
+
+/* stop the thread between two positions, so the tables can be touched */
+static void mf_mt_park(struct lzma_mf_mt *mt)
+{
+	pthread_mutex_lock(&mt->lock);
+	__atomic_store_n(&mt->pause, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&mt->cond);
+	while (!mt->parked)
+		pthread_cond_wait(&mt->cond, &mt->lock);
+	pthread_mutex_unlock(&mt->lock);
+}
+
+static void mf_mt_unpark(struct lzma_mf_mt *mt)
+{
+	pthread_mutex_lock(&mt->lock);
+	__atomic_store_n(&mt->pause, false, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&mt->cond);
+	pthread_mutex_unlock(&mt->lock);
+}
+
+/* the thread can't go any further, so go on with the serial match finder */
+static void mf_mt_takeover(struct lzma_mf *mf)
+{
+	struct lzma_mf_mt *mt = mf->mt;
+
+	mf_mt_park(mt);
+	DBG_BUGON(mt->head != mt->tail || mt->mf.cur != mf->cur);
+	/* nice_len and depth are the same, see mf_mt_get() */
+	DBG_BUGON(mt->mf.adapt.count != mf->adapt.count ||
+		  mt->mf.nice_len != mf->nice_len);
+	mf->chaincur = mt->mf.chaincur;
+	mf->unhashedskip = mt->mf.unhashedskip;
+#ifdef LZMA_STATS
+	mf->stats = mt->mf.stats;
+#endif
+	mt->serial = true;
+}
+
+/* hand the tables over to the thread if it can run ahead again */
+static bool mf_mt_handback(struct lzma_mf *mf)
+{
+	struct lzma_mf_mt *mt = mf->mt;
+
+	/* the positions rolled back by lzma_mf_skip() are hashed serially */
+	if (mf->unhashedskip ||
+	    mf->iend - (mf->buffer + mf->cur) < MATCH_LEN_MAX)
+		return false;
+
+	mt->mf = *mf;
+	mt->mf.mt = NULL;
+	/* only the encoder counts the positions to adapt, see mf_mt_get() */
+	mt->mf.adapt.depth_min = 0;
+	mt->adaptive = mf->adapt.depth_min;
+	mt->consumed = mf->adapt.count;
+	mt->decisions_taken = mt->decisions;
+	mt->iend = mf->iend;
+	/* drop what's found before the tables were taken back (if any) */
+	mt->pending = 0;
+	mt->head = mt->tail = 0;
+	mt->serial = false;
+	mf_mt_unpark(mt);
+	return true;
+}
+
+/* take the matches of the next position, or drop them if !matches */
+static unsigned int mf_mt_get(struct lzma_mf *mf, struct lzma_match *matches)
+{
+	struct lzma_mf_mt *mt = mf->mt;
+	uint32_t tail = mt->tail;
+	unsigned int n, i;
+
+	if (!mf_mt_consumer_ready(mt, 0))
+		mf_mt_wait(mt, &mt->consumer_waiting, mf_mt_consumer_ready, 0);
+
+	n = mt->ring[tail++ & LZMA_MF_MT_RING_MASK].len;
+	if (matches) {
+		for (i = 0; i < n; ++i)
+			matches[i] = mt->ring[tail++ & LZMA_MF_MT_RING_MASK];
+	} else {
+		tail += n;
+	}
+	__atomic_store_n(&mt->tail, tail, __ATOMIC_RELEASE);
+
+	++mf->cur;
+	++mf->lookahead;
+
+	/* adapt as the serial match finder does, and publish it first */
+	if (matches && mf->adapt.depth_min &&
+	    lzma_mf_adapt(mf, matches, n)) {
+		mt->next_at = mf->adapt.at;
+		mt->next_nice_len = mf->adapt.next_nice_len;
+		mt->next_depth = mf->adapt.next_depth;
+		__atomic_store_n(&mt->decisions, mt->decisions + 1,
+				 __ATOMIC_RELEASE);
+	}
+	lzma_mf_adapt_move(mf);
+	__atomic_store_n(&mt->consumed, mf->adapt.count, __ATOMIC_RELEASE);
+	mf_mt_wake(mt, &mt->producer_waiting);
+	return n;
+}
+
+bool lzma_mf_mt_find(struct lzma_mf *mf, struct lzma_match *matches,
+		     bool finish, int *ret)
+{
+	if (mf->mt->serial && !mf_mt_handback(mf))
+		return false;
+
+	/* the same as __lzma_mf_find(), and the thread never gets here */
+	if (mf->iend - (mf->buffer + mf->cur) < MATCH_LEN_MAX) {
+		if (!finish) {
+			*ret = -ERANGE;
+			return true;
+		}
+		mf_mt_takeover(mf);
+		return false;
+	}
+
+	*ret = mf_mt_get(mf, matches);
+	return true;
+}
+
+unsigned int lzma_mf_mt_skip(struct lzma_mf *mf, unsigned int n)
+{
+	if (mf->mt->serial && !mf_mt_handback(mf))
+		return n;
+
+	for (; n; --n) {
+		if (mf->iend - (mf->buffer + mf->cur) < MATCH_LEN_MAX) {
+			mf_mt_takeover(mf);
+			break;
+		}
+		mf_mt_get(mf, NULL);
+	}
+	return n;
+}
+
+void lzma_mf_mt_pause(struct lzma_mf *mf)
+{
+	struct lzma_mf_mt *mt = mf->mt;
+
+	if (mt->serial)
+		return;
+	mf_mt_park(mt);
+	mt->ahead = mt->mf.cur - mf->cur;
+}
+
+void lzma_mf_mt_fill(struct lzma_mf *mf)
+{
+	struct lzma_mf_mt *mt = mf->mt;
+
+	if (mt->serial)
+		return;
+
+	/* the window has been moved (and the tables may be rebased) */
+	if (mt->pause) {
+		mt->mf.cur = mf->cur + mt->ahead;
+		mt->mf.iend = mf->iend;
+		mt->mf.offset = mf->offset;
+		mt->iend = mf->iend;
+		mf_mt_unpark(mt);
+		return;
+	}
+
+	__atomic_store_n(&mt->iend, mf->iend, __ATOMIC_RELEASE);
+	mf_mt_wake(mt, &mt->producer_waiting);
+}
+
+void lzma_mf_mt_reset(struct lzma_mf *mf)
+{
+	struct lzma_mf_mt *mt = mf->mt;
+
+	if (!mt->serial) {
+		mf_mt_park(mt);
+		mt->serial = true;
+	}
+}
+
+int lzma_mf_mt_init(struct lzma_mf *mf)
+{
+	struct lzma_mf_mt *mt = aligned_alloc(64, sizeof(*mt));
+	int err;
+
+	if (!mt)
+		return -ENOMEM;
+
+	/* the ring is filled before being read */
+	memset(mt, 0, offsetof(struct lzma_mf_mt, ring));
+	/* the thread is parked until the encoder hands the tables over */
+	mt->serial = mt->pause = true;
+	pthread_mutex_init(&mt->lock, NULL);
+	pthread_cond_init(&mt->cond, NULL);
+
+	err = -pthread_create(&mt->thread, NULL, mf_mt_thread, mt);
+	if (err) {
+		pthread_cond_destroy(&mt->cond);
+		pthread_mutex_destroy(&mt->lock);
+		free(mt);
+		return err;
+	}
+	mf->mt = mt;
+	return 0;
+}
+
+void lzma_mf_mt_end(struct lzma_mf *mf)
+{
+	struct lzma_mf_mt *mt = mf->mt;
+
+	pthread_mutex_lock(&mt->lock);
+	mt->pause = mt->stop = true;
+	pthread_cond_broadcast(&mt->cond);
+	pthread_mutex_unlock(&mt->lock);
+	pthread_join(mt->thread, NULL);
+
+	pthread_cond_destroy(&mt->cond);
+	pthread_mutex_destroy(&mt->lock);
+	free(mt);
+	mf->mt = NULL;
+}
@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: Unlicense */
+/*
+ * lzma/rc_decoder.h - Range code decoder
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ *
+ * Authors: Igor Pavlov <http://7-zip.org/>
+ *          Lasse Collin <lasse.collin@tukaani.org>
+ *          Gao Xiang <hsiangkao@aol.com>
+ */
+#ifndef __EZ_LZMA_RC_DECODER_H
+#define __EZ_LZMA_RC_DECODER_H
+
+#include "rc_common.h"
+
+#ifndef __always_inline
+#define __always_inline		inline __attribute__((__always_inline__))
+#endif
+
+/* the first byte is always 0, the next four bytes initialize code */
+#define RC_INIT_BYTES	5
+
+struct lzma_rc_decoder {
+	uint32_t range;
+	uint32_t code;
+
+	/* the input being decoded, only valid inside a decoding loop */
+	const uint8_t *ip, *iend;
+};
+
+static inline int rc_read_init(struct lzma_rc_decoder *rc, const uint8_t *in)
+{
+	if (in[0])
+		return -EBADMSG;
+
+	rc->range = UINT32_MAX;
+	rc->code = ((uint32_t)in[1] << 24) | (in[2] << 16) |
+		(in[3] << 8) | in[4];
+	return 0;
+}
+
+/*
+ * All the following helpers take a constant @dry. If it's false, input is
+ * read without any bounds check and probabilities are updated, which is
+ * only safe if at least LZMA_REQUIRED_INPUT_MAX bytes are available.
+ *
+ * Otherwise, probabilities are kept as-is and zeroes are read beyond iend,
+ * so that rc->ip > rc->iend tells that the symbol cannot be decoded yet.
+ */
+static __always_inline void rc_normalize(struct lzma_rc_decoder *rc,
+					 const bool dry)
+{
+	if (rc->range < RC_TOP_VALUE) {
+		rc->range <<= RC_SHIFT_BITS;
+		rc->code = (rc->code << RC_SHIFT_BITS) |
+			(!dry || rc->ip < rc->iend ? *rc->ip : 0);
+		++rc->ip;
+	}
+}
+
+static __always_inline uint32_t rc_decode_bit(struct lzma_rc_decoder *rc,
+					       probability *prob,
+					       const bool dry)
+{
+	uint32_t bound;
+
+	rc_normalize(rc, dry);
+	bound = rc_bound(rc->range, *prob);
+	if (rc->code < bound) {
+		rc->range = bound;
+		if (!dry)
+			*prob += (RC_BIT_MODEL_TOTAL - *prob) >> RC_MOVE_BITS;
+		return 0;
+	}
+	rc->range -= bound;
+	rc->code -= bound;
+	if (!dry)
+		*prob -= *prob >> RC_MOVE_BITS;
+	return 1;
+}
+
+/* the counterpart of rc_bittree() in rc_encoder.h */
+static __always_inline uint32_t rc_decode_bittree(struct lzma_rc_decoder *rc,
+						   probability *probs,
+						   uint32_t nbits,
+						   const bool dry)
+{
+	const uint32_t top = 1U << nbits;
+	uint32_t symbol = 1;
+
+	do {
+		symbol = (symbol << 1) |
+			rc_decode_bit(rc, &probs[symbol], dry);
+	} while (symbol < top);
+	return symbol - top;
+}
+
+/* the counterpart of rc_bittree_reverse() in rc_encoder.h */
+static __always_inline uint32_t
+rc_decode_bittree_reverse(struct lzma_rc_decoder *rc, probability *probs,
+			  uint32_t nbits, const bool dry)
+{
+	uint32_t model_index = 1, symbol = 0, i = 0;
+
+	do {
+		const uint32_t bit = rc_decode_bit(rc, &probs[model_index],
+						   dry);
+
+		model_index = (model_index << 1) + bit;
+		symbol |= bit << i;
+	} while (++i < nbits);
+	return symbol;
+}
+
+/* shift @nbits direct bits into @val, see rc_direct() in rc_encoder.h */
+static __always_inline uint32_t rc_decode_direct(struct lzma_rc_decoder *rc,
+						 uint32_t val, uint32_t nbits,
+						 const bool dry)
+{
+	do {
+		uint32_t mask;
+
+		rc_normalize(rc, dry);
+		rc->range >>= 1;
+		/* mask = 0xFFFFFFFF if code < range, or 0 otherwise */
+		rc->code -= rc->range;
+		mask = 0U - (rc->code >> 31);
+		rc->code += rc->range & mask;
+		val = (val << 1) + (mask + 1);
+	} while (--nbits);
+	return val;
+}
+
+#endif
+
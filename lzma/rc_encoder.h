@@ -13,6 +13,10 @@
 
 #include "rc_common.h"
 
+#ifndef __always_inline
+#define __always_inline		inline __attribute__((__always_inline__))
+#endif
+
 /*
  * Maximum number of symbols that can be put pending into lzma_range_encoder
  * structure between calls to lzma_rc_encode(). For LZMA, 52+5 is enough
@@ -25,6 +29,9 @@
 #define RC_DIRECT_0	2
 #define RC_DIRECT_1	3
 #define RC_FLUSH	4
+/* a whole literal, followed by the byte (and the match byte) in symbols[] */
+#define RC_LITERAL		5
+#define RC_LITERAL_MATCHED	6
 
 struct lzma_rc_encoder {
 	uint64_t low;
@@ -32,11 +39,19 @@ struct lzma_rc_encoder {
 	uint32_t range;
 	uint8_t firstbyte;
 
+	/*
+	 * where firstbyte has been written to by rc_encode_buffered(), which
+	 * is followed by extended_bytes of 0xFF in the output buffer.
+	 */
+	uint8_t *cache;
+
 	/* Number of symbols in the tables */
 	uint8_t count;
 
 	/* rc_encode()'s position in the tables */
 	uint8_t pos;
+	/* the bits of the literal at pos which have been encoded */
+	uint8_t litbit;
 
 	/* Symbols to encode (use uint8_t so can be in a single cacheline.) */
 	uint8_t symbols[RC_SYMBOLS_MAX];
@@ -90,6 +105,50 @@ static inline void rc_bittree_reverse(struct lzma_rc_encoder *rc,
 	} while (--nbits);
 }
 
+/*
+ * Queue a literal as one entry rather than 8 rc_bit()s, which is encoded
+ * directly by rc_encode_literal(). Without a match byte, it's the same as
+ * rc_bittree(rc, probs, 8, symbol).
+ */
+static inline void rc_literal(struct lzma_rc_encoder *rc, probability *probs,
+			      uint32_t symbol)
+{
+	rc->symbols[rc->count] = RC_LITERAL;
+	rc->probs[rc->count] = probs;
+	rc->symbols[rc->count + 1] = symbol;
+	rc->count += 2;
+}
+
+static inline void rc_literal_matched(struct lzma_rc_encoder *rc,
+				      probability *probs,
+				      uint32_t match_byte, uint32_t symbol)
+{
+	rc->symbols[rc->count] = RC_LITERAL_MATCHED;
+	rc->probs[rc->count] = probs;
+	rc->symbols[rc->count + 1] = symbol;
+	rc->symbols[rc->count + 2] = match_byte;
+	rc->count += 3;
+}
+
+/* the probabilities of the literal at @i in the order of its bits */
+static inline void rc_literal_probs(const struct lzma_rc_encoder *rc,
+				    unsigned int i, probability *probs[8])
+{
+	const bool matched = (rc->symbols[i] == RC_LITERAL_MATCHED);
+	uint32_t symbol = rc->symbols[i + 1] + 0x100;
+	uint32_t match_byte = matched ? rc->symbols[i + 2] : 0;
+	uint32_t offset = matched ? 0x100 : 0;
+	unsigned int bit;
+
+	for (bit = 0; bit < 8; ++bit) {
+		const uint32_t match_bit = (match_byte <<= 1) & offset;
+
+		probs[bit] = &rc->probs[i][offset + match_bit + (symbol >> 8)];
+		symbol <<= 1;
+		offset &= ~(match_byte ^ symbol);
+	}
+}
+
 static inline void rc_direct(struct lzma_rc_encoder *rc,
 			     uint32_t val, uint32_t nbits)
 {
@@ -108,9 +167,27 @@ static inline void rc_flush(struct lzma_rc_encoder *rc)
 		rc->symbols[rc->count++] = RC_FLUSH;
 }
 
-static inline bool rc_shift_low(struct lzma_rc_encoder *rc,
-				uint8_t **ppos, uint8_t *oend)
+static __always_inline bool rc_shift_low(struct lzma_rc_encoder *rc,
+					 uint8_t **ppos, uint8_t *oend,
+					 bool buffered)
 {
+	if (buffered) {
+		/*
+		 * The pending bytes are in the output buffer already, so
+		 * a carry only needs to be added to them in place.
+		 */
+		if (rc->low >> 24 != UINT8_MAX) {
+			if (rc->low >> 32) {
+				++*rc->cache;
+				memset(rc->cache + 1, 0, *ppos - rc->cache - 1);
+			}
+			rc->cache = *ppos;
+		}
+		*(*ppos)++ = rc->low >> 24;
+		rc->low = (rc->low & 0x00FFFFFF) << RC_SHIFT_BITS;
+		return false;
+	}
+
 	if (rc->low >> 24 != UINT8_MAX) {
 		const uint32_t carrybit = rc->low >> 32;
 
@@ -137,15 +214,139 @@ static inline bool rc_shift_low(struct lzma_rc_encoder *rc,
 	return false;
 }
 
-static inline bool rc_encode(struct lzma_rc_encoder *rc,
-			     uint8_t **ppos, uint8_t *oend)
+#ifdef LZMA_RC_BRANCHLESS
+/*
+ * Build with -DLZMA_RC_BRANCHLESS to update low, range and the probability
+ * with masks of the bit instead of a branch, which is mispredicted about as
+ * often as the bit is hard to predict. The output is the same either way.
+ */
+static inline void rc_encode_bit(struct lzma_rc_encoder *rc,
+				 probability *p, uint32_t bit)
+{
+	const uint32_t mask = 0 - bit;
+	const uint32_t prob = *p;
+	const uint32_t bound = rc_bound(rc->range, prob);
+	/* the distance to move, towards 0 for 1 and to the total for 0 */
+	const uint32_t delta = ((prob & mask) |
+				((RC_BIT_MODEL_TOTAL - prob) & ~mask)) >>
+				RC_MOVE_BITS;
+
+	rc->low += bound & mask;
+	rc->range = (bound & ~mask) | ((rc->range - bound) & mask);
+	*p = prob + ((delta ^ mask) - mask);
+}
+
+/*
+ * Direct bits only halve the range, so encode the ones in a row without
+ * going back to the symbol switch until the range needs normalization.
+ */
+static inline void rc_encode_direct(struct lzma_rc_encoder *rc)
+{
+	do {
+		const uint32_t mask = 0 - (rc->symbols[rc->pos] - RC_DIRECT_0);
+
+		rc->range >>= 1;
+		rc->low += rc->range & mask;
+	} while (++rc->pos < rc->count &&
+		 (rc->symbols[rc->pos] | 1) == RC_DIRECT_1 &&
+		 rc->range >= RC_TOP_VALUE);
+}
+#else
+static inline void rc_encode_bit(struct lzma_rc_encoder *rc,
+				 probability *p, uint32_t bit)
+{
+	probability prob = *p;
+	const uint32_t bound = rc_bound(rc->range, prob);
+
+	if (!bit) {
+		rc->range = bound;
+		prob += (RC_BIT_MODEL_TOTAL - prob) >> RC_MOVE_BITS;
+	} else {
+		rc->low += bound;
+		rc->range -= bound;
+		prob -= prob >> RC_MOVE_BITS;
+	}
+	*p = prob;
+}
+#endif
+
+/*
+ * Encode the 8 bits of the literal at rc->pos without going through the
+ * symbol table for each bit. If the output is full in the middle, it can
+ * be resumed from rc->litbit, which is normalized by the caller.
+ */
+static __always_inline bool rc_encode_literal(struct lzma_rc_encoder *rc,
+					      uint8_t **ppos, uint8_t *oend,
+					      bool buffered)
+{
+	const bool matched = (rc->symbols[rc->pos] == RC_LITERAL_MATCHED);
+	probability *const probs = rc->probs[rc->pos];
+	uint32_t symbol = rc->symbols[rc->pos + 1] + 0x100;
+	uint32_t match_byte = matched ? rc->symbols[rc->pos + 2] : 0;
+	uint32_t offset = matched ? 0x100 : 0;
+	unsigned int bit;
+
+	/*
+	 * The match byte selects another subtree for each bit until a bit of
+	 * the literal differs from it. Without a match byte, offset is 0 and
+	 * it's a plain 8-bit bittree.
+	 */
+	for (bit = 0; bit < 8; ++bit) {
+		const uint32_t match_bit = (match_byte <<= 1) & offset;
+
+		if (bit >= rc->litbit) {
+			if (bit > rc->litbit && rc->range < RC_TOP_VALUE) {
+				if (rc_shift_low(rc, ppos, oend, buffered)) {
+					rc->litbit = bit;
+					return true;
+				}
+				rc->range <<= RC_SHIFT_BITS;
+			}
+			rc_encode_bit(rc, &probs[offset + match_bit +
+						 (symbol >> 8)],
+				      (symbol >> 7) & 1);
+		}
+		symbol <<= 1;
+		offset &= ~(match_byte ^ symbol);
+	}
+
+	rc->litbit = 0;
+	rc->pos += matched ? 3 : 2;
+	return false;
+}
+
+/* write the pending bytes out and keep them as rc->cache for carries */
+static inline void rc_buffer_pending(struct lzma_rc_encoder *rc,
+				     uint8_t **ppos)
+{
+	rc->cache = *ppos;
+	**ppos = rc->firstbyte;
+	memset(*ppos + 1, UINT8_MAX, rc->extended_bytes);
+	*ppos += 1 + rc->extended_bytes;
+}
+
+/* take the bytes which can still be carried into back from the buffer */
+static inline void rc_unbuffer_pending(struct lzma_rc_encoder *rc,
+				       uint8_t **ppos)
+{
+	rc->firstbyte = *rc->cache;
+	rc->extended_bytes = *ppos - rc->cache - 1;
+	*ppos = rc->cache;
+}
+
+static __always_inline bool __rc_encode(struct lzma_rc_encoder *rc,
+					uint8_t **ppos, uint8_t *oend,
+					bool buffered)
 {
 	DBG_BUGON(rc->count > RC_SYMBOLS_MAX);
 
+	if (buffered)
+		rc_buffer_pending(rc, ppos);
+
 	while (rc->pos < rc->count) {
 		/* Normalize */
 		if (rc->range < RC_TOP_VALUE) {
-			if (rc_shift_low(rc, ppos, oend))
+			if (rc_shift_low(rc, ppos, oend, buffered))
 				return true;
 
 			rc->range <<= RC_SHIFT_BITS;
@@ -153,26 +354,24 @@ static inline bool rc_encode(struct lzma_rc_encoder *rc,
 
 		/* Encode a bit */
 		switch (rc->symbols[rc->pos]) {
-		case RC_BIT_0: {
-			probability prob = *rc->probs[rc->pos];
-
-			rc->range = rc_bound(rc->range, prob);
-			prob += (RC_BIT_MODEL_TOTAL - prob) >> RC_MOVE_BITS;
-			*rc->probs[rc->pos] = prob;
+		case RC_BIT_0:
+		case RC_BIT_1:
+			rc_encode_bit(rc, rc->probs[rc->pos],
+				      rc->symbols[rc->pos]);
 			break;
-		}
-
-		case RC_BIT_1: {
-			probability prob = *rc->probs[rc->pos];
-			const uint32_t bound = rc_bound(rc->range, prob);
 
-			rc->low += bound;
-			rc->range -= bound;
-			prob -= prob >> RC_MOVE_BITS;
-			*rc->probs[rc->pos] = prob;
-			break;
-		}
+		case RC_LITERAL:
+		case RC_LITERAL_MATCHED:
+			if (rc_encode_literal(rc, ppos, oend, buffered))
+				return true;
+			continue;
 
+#ifdef LZMA_RC_BRANCHLESS
+		case RC_DIRECT_0:
+		case RC_DIRECT_1:
+			rc_encode_direct(rc);
+			continue;
+#else
 		case RC_DIRECT_0:
 			rc->range >>= 1;
 			break;
@@ -181,6 +380,7 @@ static inline bool rc_encode(struct lzma_rc_encoder *rc,
 			rc->range >>= 1;
 			rc->low += rc->range;
 			break;
+#endif
 
 		case RC_FLUSH:
 			/* Prevent further normalizations */
@@ -188,10 +388,14 @@ static inline bool rc_encode(struct lzma_rc_encoder *rc,
 
 			/* Flush the last five bytes (see rc_flush()) */
 			do {
-				if (rc_shift_low(rc, ppos, oend))
+				if (rc_shift_low(rc, ppos, oend, buffered))
 					return true;
 			} while (++rc->pos < rc->count);
 
+			/* the last pending byte is always 0, drop it as well */
+			if (buffered)
+				rc_unbuffer_pending(rc, ppos);
+
 			/*
 			 * Reset the range encoder so we are ready to continue
 			 * encoding if we weren't finishing the stream.
@@ -206,15 +410,35 @@ static inline bool rc_encode(struct lzma_rc_encoder *rc,
 		++rc->pos;
 	}
 
+	if (buffered)
+		rc_unbuffer_pending(rc, ppos);
 	rc->count = 0;
 	rc->pos = 0;
 	return false;
 }
 
+static inline bool rc_encode(struct lzma_rc_encoder *rc,
+			     uint8_t **ppos, uint8_t *oend)
+{
+	return __rc_encode(rc, ppos, oend, false);
+}
+
+/*
+ * The same as rc_encode(), but the output isn't checked byte by byte. The
+ * caller has to make sure that there is room for rc_pending() bytes and all
+ * the queued symbols, and then it can't fail.
+ */
+static inline void rc_encode_buffered(struct lzma_rc_encoder *rc,
+				      uint8_t **ppos)
+{
+	__rc_encode(rc, ppos, NULL, true);
+}
 
+/* the number of bytes which rc_flush() would output */
 static inline uint64_t rc_pending(const struct lzma_rc_encoder *rc)
 {
-	return rc->extended_bytes + 5;
+	/* normalization of the last symbol is deferred until the next one */
+	return rc->extended_bytes + 5 + (rc->range < RC_TOP_VALUE);
 }
 
 #endif
@@ -14,23 +14,65 @@ struct lzma_rc_ckpt {
 	uint64_t extended_bytes;
 	uint32_t range;
 	uint8_t firstbyte;
+
+	/*
+	 * probabilities of the pending symbols, which are updated by
+	 * rc_encode() and have to be rolled back as well.
+	 */
+	uint8_t nprobs;
+	probability *probs[RC_SYMBOLS_MAX];
+	probability values[RC_SYMBOLS_MAX];
 };
 
-void rc_write_checkpoint(struct lzma_rc_encoder *rc, struct lzma_rc_ckpt *cp)
+static inline void rc_write_checkpoint(struct lzma_rc_encoder *rc,
+				       struct lzma_rc_ckpt *cp)
 {
+	unsigned int i;
+
 	*cp = (struct lzma_rc_ckpt) { .low = rc->low,
 				      .extended_bytes = rc->extended_bytes,
 				      .range = rc->range,
-				      .firstbyte = rc->firstbyte
+				      .firstbyte = rc->firstbyte,
 	};
+
+	for (i = rc->pos; i < rc->count; ++i) {
+		if (rc->symbols[i] == RC_LITERAL ||
+		    rc->symbols[i] == RC_LITERAL_MATCHED) {
+			probability *probs[8];
+			unsigned int bit;
+
+			rc_literal_probs(rc, i, probs);
+			for (bit = 0; bit < 8; ++bit) {
+				cp->probs[cp->nprobs] = probs[bit];
+				cp->values[cp->nprobs++] = *probs[bit];
+			}
+			/* skip the byte (and the match byte) */
+			i += (rc->symbols[i] == RC_LITERAL_MATCHED) ? 2 : 1;
+			continue;
+		}
+
+		if (rc->symbols[i] > RC_BIT_1)
+			continue;
+		cp->probs[cp->nprobs] = rc->probs[i];
+		cp->values[cp->nprobs++] = *rc->probs[i];
+	}
 }
 
-void rc_restore_checkpoint(struct lzma_rc_encoder *rc, struct lzma_rc_ckpt *cp)
+/* drop all pending symbols and roll back to the checkpoint */
+static inline void rc_restore_checkpoint(struct lzma_rc_encoder *rc,
+					 struct lzma_rc_ckpt *cp)
 {
+	unsigned int i;
+
 	rc->low = cp->low;
 	rc->extended_bytes = cp->extended_bytes;
 	rc->range = cp->range;
 	rc->firstbyte = cp->firstbyte;
+	rc->litbit = 0;
+
+	/* in reverse order in case a probability is used more than once */
+	for (i = cp->nprobs; i; --i)
+		*cp->probs[i - 1] = cp->values[i - 1];
 
 	rc->pos = 0;
 	rc->count = 0;
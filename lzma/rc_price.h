@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: Unlicense */
+/*
+ * lzma/rc_price.h - Range coder price estimation
+ *
+ * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
+ *
+ * Authors: Igor Pavlov <http://7-zip.org/>
+ *          Lasse Collin <lasse.collin@tukaani.org>
+ *          Gao Xiang <hsiangkao@aol.com>
+ */
+#ifndef __EZ_LZMA_RC_PRICE_H
+#define __EZ_LZMA_RC_PRICE_H
+
+#include "rc_common.h"
+
+/* Probabilities are divided by 1 << RC_MOVE_REDUCING_BITS for pricing */
+#define RC_MOVE_REDUCING_BITS	4
+/* Prices are in 1 / (1 << RC_BIT_PRICE_SHIFT_BITS) bits */
+#define RC_BIT_PRICE_SHIFT_BITS	4
+#define RC_PRICE_TABLE_SIZE	(RC_BIT_MODEL_TOTAL >> RC_MOVE_REDUCING_BITS)
+
+#define RC_INFINITY_PRICE	(1U << 30)
+
+/*
+ * rc_prices[i] = -log2((i + 0.5) / RC_PRICE_TABLE_SIZE) in
+ * 1 / (1 << RC_BIT_PRICE_SHIFT_BITS) bits, the same as lzma_rc_prices of xz.
+ */
+static const uint8_t rc_prices[RC_PRICE_TABLE_SIZE] = {
+	128, 103,  91,  84,  78,  73,  69,  66,
+	 63,  61,  58,  56,  54,  52,  51,  49,
+	 48,  46,  45,  44,  43,  42,  41,  40,
+	 39,  38,  37,  36,  35,  34,  34,  33,
+	 32,  31,  31,  30,  29,  29,  28,  28,
+	 27,  26,  26,  25,  25,  24,  24,  23,
+	 23,  22,  22,  22,  21,  21,  20,  20,
+	 19,  19,  19,  18,  18,  17,  17,  17,
+	 16,  16,  16,  15,  15,  15,  14,  14,
+	 14,  13,  13,  13,  12,  12,  12,  11,
+	 11,  11,  11,  10,  10,  10,  10,   9,
+	  9,   9,   9,   8,   8,   8,   8,   7,
+	  7,   7,   7,   6,   6,   6,   6,   5,
+	  5,   5,   5,   5,   4,   4,   4,   4,
+	  3,   3,   3,   3,   3,   2,   2,   2,
+	  2,   2,   2,   1,   1,   1,   1,   1,
+};
+
+static inline uint32_t rc_bit_price(const probability prob, const uint32_t bit)
+{
+	return rc_prices[(prob ^ ((0U - bit) & (RC_BIT_MODEL_TOTAL - 1))) >>
+			 RC_MOVE_REDUCING_BITS];
+}
+
+static inline uint32_t rc_bit_0_price(const probability prob)
+{
+	return rc_prices[prob >> RC_MOVE_REDUCING_BITS];
+}
+
+static inline uint32_t rc_bit_1_price(const probability prob)
+{
+	return rc_prices[(prob ^ (RC_BIT_MODEL_TOTAL - 1)) >>
+			 RC_MOVE_REDUCING_BITS];
+}
+
+/* the price of what rc_bittree() would encode */
+static inline uint32_t rc_bittree_price(const probability *const probs,
+					uint32_t nbits, uint32_t symbol)
+{
+	uint32_t price = 0;
+
+	symbol += 1U << nbits;
+	do {
+		const uint32_t bit = symbol & 1;
+
+		symbol >>= 1;
+		price += rc_bit_price(probs[symbol], bit);
+	} while (symbol != 1);
+	return price;
+}
+
+/* the price of what rc_bittree_reverse() would encode */
+static inline uint32_t rc_bittree_reverse_price(const probability *const probs,
+						uint32_t nbits, uint32_t symbol)
+{
+	uint32_t price = 0;
+	uint32_t model_index = 1;
+
+	do {
+		const uint32_t bit = symbol & 1;
+
+		symbol >>= 1;
+		price += rc_bit_price(probs[model_index], bit);
+		model_index = (model_index << 1) + bit;
+	} while (--nbits);
+	return price;
+}
+
+/* direct bits are always encoded with the probability of 1/2 */
+static inline uint32_t rc_direct_price(const uint32_t nbits)
+{
+	return nbits << RC_BIT_PRICE_SHIFT_BITS;
+}
+
+#endif
+
@@ -1 +1,2 @@
-gcc -g -I ../include lzma_encoder.c mf.c
+gcc -g -I ../include main.c lzma_encoder.c lzma_decoder.c lzma_mt.c lzma_pool.c lzma2_encoder.c lzma_xz.c crc.c mf.c mf_mt.c -lpthread
+gcc -O2 -DNDEBUG -I ../include bench.c lzma_encoder.c lzma_decoder.c mf.c mf_mt.c -lpthread -o bench